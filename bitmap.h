@@ -8,6 +8,7 @@
 #define _OUICHEFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/spinlock.h>
 #include "ouichefs.h"
 
 /*
@@ -31,6 +32,12 @@ static inline uint32_t get_first_free_bit(unsigned long *freemap,
 	return ino;
 }
 
+/*
+ * The free bitmaps, their counters and s_reserved_blocks are shared by all
+ * inodes: blocks are allocated from writeback, fsync() and direct I/O of
+ * several files at once. They are only changed under sbi->s_alloc_lock.
+ */
+
 /*
  * Return an unused inode number and mark it used.
  * Return 0 if no free inode was found.
@@ -39,32 +46,144 @@ static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
 {
 	uint32_t ret;
 
+	spin_lock(&sbi->s_alloc_lock);
 	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
-	if (ret) {
+	if (ret)
 		sbi->nr_free_inodes--;
+	spin_unlock(&sbi->s_alloc_lock);
+	if (ret)
 		pr_debug("%s:%d: allocated inode %u\n", __func__, __LINE__,
 			 ret);
-	}
+	return ret;
+}
+
+/* Free blocks not promised to delayed allocations, s_alloc_lock held */
+static inline uint32_t __free_blocks_avail(struct ouichefs_sb_info *sbi)
+{
+	return sbi->nr_free_blocks > sbi->s_reserved_blocks ?
+		       sbi->nr_free_blocks - sbi->s_reserved_blocks :
+		       0;
+}
+
+static inline uint32_t __get_free_block(struct ouichefs_sb_info *sbi)
+{
+	uint32_t ret;
+
+	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
+	if (ret)
+		sbi->nr_free_blocks--;
 	return ret;
 }
 
 /*
- * Return an unused block number and mark it used.
+ * Return an unused block number and mark it used, leaving the reserved
+ * blocks alone.
  * Return 0 if no free block was found.
  */
 static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
+{
+	uint32_t ret = 0;
+
+	spin_lock(&sbi->s_alloc_lock);
+	if (__free_blocks_avail(sbi))
+		ret = __get_free_block(sbi);
+	spin_unlock(&sbi->s_alloc_lock);
+	if (ret)
+		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
+			 ret);
+	return ret;
+}
+
+/*
+ * Same as get_free_block(), for a caller that holds a reservation covering
+ * the block (see reserve_blocks()).
+ */
+static inline uint32_t get_reserved_block(struct ouichefs_sb_info *sbi)
 {
 	uint32_t ret;
 
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
-	if (ret) {
-		sbi->nr_free_blocks--;
+	spin_lock(&sbi->s_alloc_lock);
+	ret = __get_free_block(sbi);
+	spin_unlock(&sbi->s_alloc_lock);
+	if (ret)
 		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
 			 ret);
+	return ret;
+}
+
+/*
+ * Mark block bno as used if it is free, used to grow a run of contiguous
+ * blocks. The caller holds a reservation covering it.
+ * Return bno on success, 0 if the block is not free.
+ */
+static inline uint32_t get_free_block_at(struct ouichefs_sb_info *sbi,
+					 uint32_t bno)
+{
+	uint32_t ret = 0;
+
+	if (bno >= sbi->nr_blocks)
+		return 0;
+
+	spin_lock(&sbi->s_alloc_lock);
+	if (test_bit(bno, sbi->bfree_bitmap)) {
+		bitmap_clear(sbi->bfree_bitmap, bno, 1);
+		sbi->nr_free_blocks--;
+		ret = bno;
+	}
+	spin_unlock(&sbi->s_alloc_lock);
+	if (ret)
+		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
+			 bno);
+
+	return ret;
+}
+
+/*
+ * Reserve nr free blocks for a later get_reserved_block(), so that other
+ * allocations cannot take them. Return false if there are not enough.
+ */
+static inline bool reserve_blocks(struct ouichefs_sb_info *sbi, uint32_t nr)
+{
+	bool ret = false;
+
+	spin_lock(&sbi->s_alloc_lock);
+	if (__free_blocks_avail(sbi) >= nr) {
+		sbi->s_reserved_blocks += nr;
+		ret = true;
+	}
+	spin_unlock(&sbi->s_alloc_lock);
+
+	return ret;
+}
+
+/*
+ * Reserve up to max free blocks on top of min ones, return the number of
+ * blocks reserved beyond min, or -ENOSPC if not even min + 1 are free.
+ */
+static inline int reserve_some_blocks(struct ouichefs_sb_info *sbi,
+				      uint32_t min, uint32_t max)
+{
+	uint32_t avail;
+	int ret = -ENOSPC;
+
+	spin_lock(&sbi->s_alloc_lock);
+	avail = __free_blocks_avail(sbi);
+	if (avail > min) {
+		ret = min_t(uint32_t, max, avail - min);
+		sbi->s_reserved_blocks += min + ret;
 	}
+	spin_unlock(&sbi->s_alloc_lock);
+
 	return ret;
 }
 
+static inline void unreserve_blocks(struct ouichefs_sb_info *sbi, uint32_t nr)
+{
+	spin_lock(&sbi->s_alloc_lock);
+	sbi->s_reserved_blocks -= nr;
+	spin_unlock(&sbi->s_alloc_lock);
+}
+
 /*
  * Mark the i-th bit in freemap as free (i.e. 1)
  */
@@ -85,10 +204,10 @@ static inline int put_free_bit(unsigned long *freemap, unsigned long size,
  */
 static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
-		return;
-
-	sbi->nr_free_inodes++;
+	spin_lock(&sbi->s_alloc_lock);
+	if (!put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
+		sbi->nr_free_inodes++;
+	spin_unlock(&sbi->s_alloc_lock);
 	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
 }
 
@@ -97,11 +216,28 @@ static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
  */
 static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
+	spin_lock(&sbi->s_alloc_lock);
+	if (!put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
+		sbi->nr_free_blocks++;
+	spin_unlock(&sbi->s_alloc_lock);
+	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
+}
+
+/*
+ * Mark the len blocks from bno as unused, with a single bitmap update.
+ */
+static inline void put_blocks(struct ouichefs_sb_info *sbi, uint32_t bno,
+			      uint32_t len)
+{
+	if (bno + len > sbi->nr_blocks)
 		return;
 
-	sbi->nr_free_blocks++;
-	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
+	spin_lock(&sbi->s_alloc_lock);
+	bitmap_set(sbi->bfree_bitmap, bno, len);
+	sbi->nr_free_blocks += len;
+	spin_unlock(&sbi->s_alloc_lock);
+	pr_debug("%s:%d: freed blocks %u-%u\n", __func__, __LINE__, bno,
+		 bno + len - 1);
 }
 
 static inline void copy_bitmap_from_le64(unsigned long *dst, __le64 *src)
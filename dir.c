@@ -10,8 +10,12 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
 
 #include "ouichefs.h"
+#include "ioctl.h"
 
 /*
  * Iterate over the files contained in dir and commit them in ctx.
@@ -65,8 +69,172 @@ static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 	return 0;
 }
 
+/* A file of a batched read, sorted by the sliced block holding it */
+struct batch_entry {
+	struct inode *inode;
+	uint32_t bno;
+	unsigned int idx;
+};
+
+static int batch_cmp(const void *a, const void *b)
+{
+	const struct batch_entry *x = a, *y = b;
+
+	if (x->bno != y->bno)
+		return x->bno < y->bno ? -1 : 1;
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/* Get the inode of the file described by rec in the directory index dblock */
+static struct inode *batch_lookup(struct super_block *sb,
+				  struct ouichefs_dir_block *dblock,
+				  struct ouichefs_read_file *rec)
+{
+	struct ouichefs_file *f;
+	int i;
+
+	if (!rec->ino && strnlen(rec->name, sizeof(rec->name)) ==
+				 sizeof(rec->name))
+		return ERR_PTR(-ENAMETOOLONG);
+
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+		f = &dblock->files[i];
+		if (!f->inode)
+			break;
+		if (rec->ino ? le32_to_cpu(f->inode) == rec->ino :
+			       !strncmp(f->filename, rec->name,
+					OUICHEFS_FILENAME_LEN))
+			return ouichefs_iget(sb, le32_to_cpu(f->inode));
+	}
+
+	return ERR_PTR(-ENOENT);
+}
+
+/*
+ * Read a batch of small files of the directory opened as file into a single
+ * user buffer. The directory index is read once to find all of them, then
+ * the files are copied in the order of their sliced blocks so that each
+ * block is read once. A file that cannot be read, or does not fit in what
+ * is left of the buffer, gets a negative errno as size and is skipped.
+ * Returns the number of files read.
+ */
+long ouichefs_read_batch(struct file *file, void __user *argp)
+{
+	struct ouichefs_read_batch_ioctl arg;
+	struct ouichefs_read_file *files, *rec;
+	struct batch_entry *entries = NULL;
+	struct inode *dir = file_inode(file);
+	struct super_block *sb = dir->i_sb;
+	struct mnt_idmap *idmap = file_mnt_idmap(file);
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh = NULL;
+	struct inode *inode;
+	unsigned int off = 0, nr = 0, n = 0, i;
+	char *kbuf = NULL;
+	ssize_t size;
+	long ret;
+
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+	/* Every file is looked up in the directory */
+	if (arg.nr_files > OUICHEFS_MAX_SUBFILES)
+		return -E2BIG;
+	if (!arg.nr_files)
+		return 0;
+
+	ret = inode_permission(idmap, dir, MAY_EXEC);
+	if (ret)
+		return ret;
+
+	files = memdup_user(arg.files, array_size(arg.nr_files, sizeof(*files)));
+	if (IS_ERR(files))
+		return PTR_ERR(files);
+	entries = kcalloc(arg.nr_files, sizeof(*entries), GFP_KERNEL);
+	kbuf = kmalloc(OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+	if (!entries || !kbuf) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	inode_lock_shared(dir);
+	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh) {
+		inode_unlock_shared(dir);
+		ret = -EIO;
+		goto free;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	for (i = 0; i < arg.nr_files; i++) {
+		files[i].offset = 0;
+		inode = batch_lookup(sb, dblock, &files[i]);
+		if (IS_ERR(inode)) {
+			files[i].size = PTR_ERR(inode);
+			continue;
+		}
+		entries[nr].inode = inode;
+		entries[nr].bno =
+			READ_ONCE(OUICHEFS_INODE(inode)->index_block) >> 5;
+		entries[nr].idx = i;
+		nr++;
+	}
+	brelse(bh);
+	bh = NULL;
+	inode_unlock_shared(dir);
+
+	/* Files sharing a sliced block follow each other, it is read once */
+	sort(entries, nr, sizeof(*entries), batch_cmp, NULL);
+	for (i = 0; i < nr; i++) {
+		inode = entries[i].inode;
+		rec = &files[entries[i].idx];
+
+		if (!S_ISREG(inode->i_mode))
+			size = -EISDIR;
+		else
+			size = inode_permission(idmap, inode, MAY_READ);
+		if (!size)
+			size = ouichefs_read_small_file(inode, &bh, kbuf);
+		if (size > 0 && size > arg.buf_size - off)
+			size = -ENOSPC;
+		if (size > 0 && copy_to_user(arg.buf + off, kbuf, size))
+			size = -EFAULT;
+		if (size >= 0) {
+			rec->offset = off;
+			off += size;
+			n++;
+		}
+		rec->size = size;
+	}
+	brelse(bh);
+
+	ret = n;
+	if (copy_to_user(arg.files, files,
+			 array_size(arg.nr_files, sizeof(*files))))
+		ret = -EFAULT;
+free:
+	for (i = 0; i < nr; i++)
+		iput(entries[i].inode);
+	kfree(kbuf);
+	kfree(entries);
+	kfree(files);
+	return ret;
+}
+
+static long ouichefs_dir_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	switch (cmd) {
+	case OUICHEFS_INGEST_IOCTL:
+		return ouichefs_ingest(file, (void __user *)arg);
+	case OUICHEFS_READ_BATCH_IOCTL:
+		return ouichefs_read_batch(file, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 const struct file_operations ouichefs_dir_ops = {
 	.owner = THIS_MODULE,
 	.iterate_shared = ouichefs_iterate,
+	.unlocked_ioctl = ouichefs_dir_ioctl,
 	.fsync = generic_file_fsync,
 };
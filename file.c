@@ -11,1286 +11,3078 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
-#include <linux/mpage.h>
+#include <linux/falloc.h>
+#include <linux/iomap.h>
+#include <linux/pagemap.h>
 #include <linux/uio.h>
 #include <linux/types.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
 
+static bool is_small_file(struct inode *inode)
+{
+	return inode->i_blocks == 0;
+}
+
+/* Smallest slice class in which a small file of size bytes fits */
+static uint32_t slice_class(loff_t size)
+{
+	uint32_t class = 0;
+
+	while (class < OUICHEFS_NR_SLICE_CLASSES - 1 &&
+	       size > OUICHEFS_SLICE_CLASS_MAX_SLICES *
+			      OUICHEFS_SLICE_CLASS_SIZE(class))
+		class++;
+
+	return class;
+}
+
+/* Size of the slices of sliced block bh */
+static size_t slice_size(struct buffer_head *bh)
+{
+	return OUICHEFS_SLICE_CLASS_SIZE(OUICHEFS_SLICED_BLOCK_SB_CLASS(bh));
+}
+
+/* Data of slice slice_no (counted from 1) of sliced block bh */
+static char *slice_data(struct buffer_head *bh, uint32_t slice_no)
+{
+	return bh->b_data + OUICHEFS_SLICE_SIZE + (slice_no - 1) * slice_size(bh);
+}
+
 /*
- * Map the buffer_head passed in argument with the iblock-th block of the file
- * represented by inode. If the requested block is not allocated and create is
- * true, allocate a new block on disk and map it.
+ * Each directory remembers the sliced block of each class in which it last
+ * placed a small file, so that the small files of a directory share sliced
+ * blocks. Returns a reference to the parent directory of inode, or NULL.
  */
-static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
-				   struct buffer_head *bh_result, int create)
+static struct inode *slice_hint_dir(struct inode *inode)
 {
-	struct super_block *sb = inode->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	int ret = 0, bno;
+	struct dentry *dentry, *parent;
+	struct inode *dir;
 
-	/* If block number exceeds filesize, fail */
-	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
-		return -EFBIG;
+	dentry = d_find_alias(inode);
+	if (!dentry)
+		return NULL;
+	parent = dget_parent(dentry);
+	dir = igrab(d_inode(parent));
+	dput(parent);
+	dput(dentry);
 
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
-		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	return dir;
+}
 
-	/*
-	 * Check if iblock is already allocated. If not and create is true,
-	 * allocate it. Else, get the physical block number.
-	 */
-	if (index->blocks[iblock] == 0) {
-		if (!create) {
-			ret = 0;
-			goto brelse_index;
-		}
-		bno = get_free_block(sbi);
-		if (!bno) {
-			ret = -ENOSPC;
-			goto brelse_index;
-		}
-		index->blocks[iblock] = cpu_to_le32(bno);
-		mark_buffer_dirty(bh_index);
-	} else {
-		bno = le32_to_cpu(index->blocks[iblock]);
-	}
+/*
+ * Read the index block bno (root, indirect block or extent block) and return a
+ * copy of its entries in CPU byte order.
+ */
+static uint32_t *ouichefs_read_index(struct super_block *sb, uint32_t bno)
+{
+	struct buffer_head *bh_index;
+	__le32 *raw;
+	uint32_t *map;
+	int i;
 
-	/* Map the physical block to the given buffer_head */
-	map_bh(bh_result, sb, bno);
+	map = kmalloc_array(OUICHEFS_INDEX_ENTRIES, sizeof(*map), GFP_NOFS);
+	if (!map)
+		return ERR_PTR(-ENOMEM);
 
-brelse_index:
+	bh_index = sb_bread(sb, bno);
+	if (!bh_index) {
+		kfree(map);
+		return ERR_PTR(-EIO);
+	}
+	raw = (__le32 *)bh_index->b_data;
+	for (i = 0; i < OUICHEFS_INDEX_ENTRIES; i++)
+		map[i] = le32_to_cpu(raw[i]);
 	brelse(bh_index);
 
-	return ret;
+	return map;
 }
 
 /*
- * Called by the page cache to read a page from the physical disk and map it in
- * memory.
+ * Return the in-memory copy of the index block of a big file, reading it from
+ * disk on first use. The caller holds ci->block_map_lock.
  */
-static void ouichefs_readahead(struct readahead_control *rac)
+static uint32_t *ouichefs_get_block_map(struct inode *inode)
 {
-	mpage_readahead(rac, ouichefs_file_get_block);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t *map;
+
+	if (ci->block_map)
+		return ci->block_map;
+
+	map = ouichefs_read_index(inode->i_sb, ci->index_block);
+	if (!IS_ERR(map))
+		ci->block_map = map;
+
+	return map;
 }
 
 /*
- * Called by the page cache to write a dirty page to the physical disk (when
- * sync is called or when memory is needed).
+ * Free the in-memory block map of inode, indirect levels included. It is read
+ * again from the index block on next use.
  */
-static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
+void ouichefs_drop_block_map(struct inode *inode)
 {
-	return block_write_full_page(page, ouichefs_file_get_block, wbc);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	mutex_lock(&ci->block_map_lock);
+	kfree(ci->block_map);
+	kfree(ci->ind_map);
+	kfree(ci->dind_map);
+	ci->block_map = NULL;
+	ci->ind_map = NULL;
+	ci->dind_map = NULL;
+	mutex_unlock(&ci->block_map_lock);
 }
 
 /*
- * Called by the VFS when a write() syscall occurs on file before writing the
- * data in the page cache. This functions checks if the write will be able to
- * complete and allocates the necessary blocks through block_write_begin().
+ * Zero the freshly allocated index block bno of inode. The block may hold
+ * stale data, so it is not read.
  */
-static int ouichefs_write_begin(struct file *file,
-				struct address_space *mapping, loff_t pos,
-				unsigned int len, struct page **pagep,
-				void **fsdata)
+static int ouichefs_zero_index_block(struct inode *inode, uint32_t bno)
 {
-	pr_info("%s:%d: pos=%lld, len=%u\n", __func__, __LINE__, pos, len);
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
-	int err;
-	uint32_t nr_allocs = 0;
+	struct buffer_head *bh_index;
 
-	/* Check if the write can be completed (enough space?) */
-	if (pos + len > OUICHEFS_MAX_FILESIZE)
-		return -ENOSPC;
-	nr_allocs = max(pos + len, file->f_inode->i_size) / OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > file->f_inode->i_blocks - 1)
-		nr_allocs -= file->f_inode->i_blocks - 1;
-	else
-		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
-		return -ENOSPC;
+	bh_index = sb_getblk(inode->i_sb, bno);
+	if (!bh_index)
+		return -EIO;
+	lock_buffer(bh_index);
+	memset(bh_index->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh_index);
+	unlock_buffer(bh_index);
+	mark_buffer_dirty_inode(bh_index, inode);
+	brelse(bh_index);
 
-	/* prepare the write */
-	err = block_write_begin(mapping, pos, len, pagep,
-				ouichefs_file_get_block);
-	/* if this failed, reclaim newly allocated blocks */
-	if (err < 0) {
-		pr_err("%s:%d: newly allocated blocks reclaim not implemented yet\n",
-		       __func__, __LINE__);
-	}
-	return err;
+	return 0;
 }
 
 /*
- * Called by the VFS after writing data from a write() syscall to the page
- * cache. This functions updates inode metadata and truncates the file if
- * necessary.
+ * Free the index block bno. Its buffer may still be dirty, forget it so that
+ * it does not overwrite the block once it is reused.
  */
-static int ouichefs_write_end(struct file *file, struct address_space *mapping,
-			      loff_t pos, unsigned int len, unsigned int copied,
-			      struct page *page, void *fsdata)
+static void ouichefs_free_index_block(struct super_block *sb, uint32_t bno)
 {
-	pr_info("%s:%d: pos=%lld, len=%u\n", __func__, __LINE__, pos, len);
-	int ret;
-	struct inode *inode = file->f_inode;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh = sb_find_get_block(sb, bno);
 
-	/* Complete the write() */
-	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-	if (ret < len) {
-		pr_err("%s:%d: wrote less than asked... what do I do? nothing for now...\n",
-		       __func__, __LINE__);
-	} else {
-		uint32_t nr_blocks_old = inode->i_blocks;
+	if (bh)
+		bforget(bh);
+	put_block(OUICHEFS_SB(sb), bno);
+}
 
-		/* Update inode metadata */
-		inode->i_blocks = (roundup(inode->i_size, OUICHEFS_BLOCK_SIZE) /
-				   OUICHEFS_BLOCK_SIZE) +
-				  1;
-		inode->i_mtime = inode->i_ctime = current_time(inode);
-		mark_inode_dirty(inode);
+/*
+ * Copy the in-memory block map of inode back to its index block, which the
+ * caller already read in bh_index. Both index formats are made of __le32
+ * words only.
+ */
+static void ouichefs_sync_block_map(struct inode *inode, uint32_t *map,
+				    struct buffer_head *bh_index)
+{
+	__le32 *raw = (__le32 *)bh_index->b_data;
+	int i;
 
-		/* If file is smaller than before, free unused blocks */
-		if (nr_blocks_old > inode->i_blocks) {
-			int i;
-			struct buffer_head *bh_index;
-			struct ouichefs_file_index_block *index;
-
-			/* Free unused blocks from page cache */
-			truncate_pagecache(inode, inode->i_size);
-
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
-			if (!bh_index) {
-				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
-				       file->f_path.dentry->d_name.name,
-				       nr_blocks_old - inode->i_blocks);
-				goto end;
-			}
-			index = (struct ouichefs_file_index_block *)
-					bh_index->b_data;
-
-			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
-			     i++) {
-				put_block(OUICHEFS_SB(sb),
-					  le32_to_cpu(index->blocks[i]));
-				index->blocks[i] = 0;
-			}
-			mark_buffer_dirty(bh_index);
-			brelse(bh_index);
-		}
-	}
-end:
-	return ret;
+	for (i = 0; i < OUICHEFS_INDEX_ENTRIES; i++)
+		raw[i] = cpu_to_le32(map[i]);
+
+	/*
+	 * Attach the index block to the inode so that fsync() flushes it
+	 * along with the data (see sync_mapping_buffers()).
+	 */
+	mark_buffer_dirty_inode(bh_index, inode);
 }
 
-const struct address_space_operations ouichefs_aops = {
-	.readahead = ouichefs_readahead,
-	.writepage = ouichefs_writepage,
-	.write_begin = ouichefs_write_begin,
-	.write_end = ouichefs_write_end
-};
+/* Flags of ouichefs_map_blocks() */
+#define OUICHEFS_MAP_CREATE (1 << 0) /* Allocate the holes */
+#define OUICHEFS_MAP_UNWRITTEN (1 << 1) /* Allocate them as unwritten blocks */
+#define OUICHEFS_MAP_DELALLOC (1 << 2) /* They are reserved by buffered writes */
 
-static int ouichefs_open(struct inode *inode, struct file *file)
+/*
+ * Upper bound of the index blocks needed to map nr more blocks past the
+ * direct ones: the index block, plus for a flat index the indirect, double
+ * indirect and leaf blocks.
+ */
+static uint32_t ouichefs_meta_blocks(struct ouichefs_sb_info *sbi, uint32_t nr)
 {
-	bool wronly = (file->f_flags & O_WRONLY) != 0;
-	bool rdwr = (file->f_flags & O_RDWR) != 0;
-	bool trunc = (file->f_flags & O_TRUNC) != 0;
-
-	if ((wronly || rdwr) && trunc && (inode->i_size != 0)) {
-		struct super_block *sb = inode->i_sb;
-		struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-		struct ouichefs_file_index_block *index;
-		struct buffer_head *bh_index;
-		sector_t iblock;
+	if (!nr)
+		return 0;
+	if (OUICHEFS_HAS_EXTENTS(sbi))
+		return 1;
+	return 4 + DIV_ROUND_UP(nr, OUICHEFS_INDEX_ENTRIES);
+}
 
-		/* Read index block from disk */
-		bh_index = sb_bread(sb, ci->index_block);
-		if (!bh_index)
-			return -EIO;
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+/*
+ * Allocate up to max_blocks contiguous blocks, starting at goal if it is free
+ * (0 for no preference). Return the number of blocks allocated and store the
+ * first one in *first, or return 0 if the disk is full.
+ */
+static uint32_t ouichefs_alloc_run(struct ouichefs_sb_info *sbi, uint32_t goal,
+				   uint32_t max_blocks, uint32_t *first)
+{
+	uint32_t len;
 
-		for (iblock = 0; index->blocks[iblock] != 0; iblock++) {
-			put_block(sbi, le32_to_cpu(index->blocks[iblock]));
-			index->blocks[iblock] = 0;
-		}
-		inode->i_size = 0;
+	if (goal && get_free_block_at(sbi, goal))
+		*first = goal;
+	else
+		*first = get_reserved_block(sbi);
+	if (!*first)
+		return 0;
 
-		mark_buffer_dirty(bh_index);
-		brelse(bh_index);
+	for (len = 1; len < max_blocks; len++) {
+		if (!get_free_block_at(sbi, *first + len))
+			break;
 	}
 
-	return 0;
+	return len;
 }
 
-static bool is_small_file(struct inode *inode)
+/*
+ * Run of physically contiguous blocks being freed. Blocks are added one at a
+ * time, the free block bitmap is updated once per run.
+ */
+struct ouichefs_free_run {
+	uint32_t start;
+	uint32_t len;
+};
+
+static void ouichefs_free_run_flush(struct ouichefs_sb_info *sbi,
+				    struct ouichefs_free_run *run)
 {
-	return inode->i_blocks == 0;
+	if (run->len)
+		put_blocks(sbi, run->start, run->len);
+	run->len = 0;
 }
 
-static ssize_t custom_read_iter(struct kiocb *iocb, struct iov_iter *to)
+/* Add the block of a flat index entry (0 for a hole) to run */
+static void ouichefs_free_run_add(struct ouichefs_sb_info *sbi,
+				  struct ouichefs_free_run *run,
+				  uint32_t entry)
 {
-	struct file *file = iocb->ki_filp;
-	struct inode *inode = file_inode(file);
-	struct super_block *sb = inode->i_sb;
-	// struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index = NULL, *bh_data = NULL;
-	loff_t pos = iocb->ki_pos;
-	size_t count = iov_iter_count(to);
-	ssize_t ret = 0;
-	ssize_t copied = 0;
-
-	pr_info("NEW READ CALL! pos=%lld, count=%zu, inode->i_size=%lld\n",
-		(long long)pos, count, (long long)inode->i_size);
+	uint32_t bno = entry & ~OUICHEFS_UNWRITTEN;
 
-	/* Check if read position is beyond file size */
-	if (pos >= inode->i_size) {
-		pr_info("pos is beyond file size, returning 0\n");
-		return 0;
+	if (!bno)
+		return;
+	if (run->len && run->start + run->len == bno) {
+		run->len++;
+		return;
 	}
 
-	/* Limit read to file size */
-	if (pos + count > inode->i_size)
-		count = inode->i_size - pos;
+	ouichefs_free_run_flush(sbi, run);
+	run->start = bno;
+	run->len = 1;
+}
 
-	if (count == 0)
-		return 0;
+/*
+ * Flat index: one block number per file block. Look up the idx-th entry of
+ * map and return the length of the run of physically contiguous blocks (or of
+ * holes) starting there, within the max_blocks following entries.
+ */
+static uint32_t ouichefs_flat_lookup(uint32_t *map, uint32_t idx,
+				     uint32_t max_blocks, uint32_t *bno)
+{
+	uint32_t len;
 
-	/* Check if we want to read a small or a big file (more/less than 128 bytes)
-		Reading big files is implemented already using index blocks,
-		Small files will be read from a sliced block.
-	*/
-	if (is_small_file(inode)) {
-		pr_info("Reading small file\n");
-	} else {
-		pr_info("Reading big file\n");
-		goto BIG_FILE;
+	*bno = map[idx];
+	for (len = 1; len < max_blocks; len++) {
+		if (*bno ? map[idx + len] != *bno + len :
+			   map[idx + len] != 0)
+			break;
 	}
 
-	uint32_t bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
-	uint32_t slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
+	return len;
+}
 
-	bh_data = sb_bread(sb, bno);
-	if (!bh_data) {
-		pr_err("Failed to read sliced block %u\n", bno);
-		ret = -EIO;
-		goto out;
-	}
+/* Same as ouichefs_flat_lookup(), on an index block that is not cached */
+static uint32_t ouichefs_flat_lookup_raw(__le32 *raw, uint32_t idx,
+					 uint32_t max_blocks, uint32_t *bno)
+{
+	uint32_t len;
 
-	/* Check if slice_no is valid */
-	if (slice_no == 0 ||
-	    slice_no >= OUICHEFS_SLICE_SIZE / sizeof(uint32_t)) {
-		pr_err("Slice number %u out of range\n", slice_no);
-		ret = -EIO;
-		brelse(bh_data);
-		goto out;
+	*bno = le32_to_cpu(raw[idx]);
+	for (len = 1; len < max_blocks; len++) {
+		if (le32_to_cpu(raw[idx + len]) != (*bno ? *bno + len : 0))
+			break;
 	}
 
-	pr_info("slice bitmap: %u\n", OUICHEFS_SLICED_BLOCK_SB_BITMAP(bh_data));
+	return len;
+}
 
-	/* TODO: DO WE READ ALL THE SLICES FOR THIS FILE? */
-	/* Copy data to user space */
-	if (copy_to_iter(bh_data->b_data + slice_no * OUICHEFS_SLICE_SIZE,
-			 count, to) != count) {
-		brelse(bh_data);
-		ret = -EFAULT;
-		goto out;
+/*
+ * Flat index: allocate the hole of hole_len entries at idx in the index block
+ * raw (and in its cached copy map, if any), following the block before it on
+ * disk if possible.
+ */
+static int ouichefs_flat_alloc(struct ouichefs_sb_info *sbi, uint32_t *map,
+			       __le32 *raw, uint32_t idx, uint32_t hole_len,
+			       uint32_t *bno, unsigned int flags)
+{
+	uint32_t state = flags & OUICHEFS_MAP_UNWRITTEN ? OUICHEFS_UNWRITTEN : 0;
+	uint32_t goal = 0, len, i;
+
+	if (idx && raw[idx - 1])
+		goal = (le32_to_cpu(raw[idx - 1]) & ~OUICHEFS_UNWRITTEN) + 1;
+
+	len = ouichefs_alloc_run(sbi, goal, hole_len, bno);
+	if (!len)
+		return -ENOSPC;
+
+	*bno |= state;
+	for (i = 0; i < len; i++) {
+		raw[idx + i] = cpu_to_le32(*bno + i);
+		if (map)
+			map[idx + i] = *bno + i;
 	}
 
-	/* Update file position */
-	/* We can always read the entire file if we wish to if its a small file, 
-	thus "pos" is unnecessary here and we just set position to count */
-	iocb->ki_pos = count;
-	ret = count;
+	return len;
+}
 
-	goto out;
-BIG_FILE:
+/*
+ * Flat index: map up to max_blocks entries from the idx-th one of the index
+ * block level_bno. map is the cached copy of the index block, or NULL if it is
+ * not cached (double indirect leaves), in which case it is read.
+ */
+static int ouichefs_flat_map_level(struct inode *inode, uint32_t *map,
+				   uint32_t level_bno, uint32_t idx,
+				   uint32_t max_blocks, uint32_t *bno,
+				   unsigned int flags, bool *new)
+{
+	bool create = flags & OUICHEFS_MAP_CREATE;
+	struct buffer_head *bh_index;
+	__le32 *raw;
+	int ret = 0;
 
-	/* Check if index block has NOT yet been set */
-	if (ci->index_block == 0) {
-		/* We should never reach this. If trying to read a file that has not had any data written to it,
-		that case should be caught when checking the read position vs the file size previously in this function.
-		*/
-		pr_err("index_block == 0, this should not happen!\n");
-		return 0;
+	if (map) {
+		ret = ouichefs_flat_lookup(map, idx, max_blocks, bno);
+		if (*bno || !create)
+			return ret;
 	}
 
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index) {
-		pr_err("%s: failed to read index block\n", __func__);
+	bh_index = sb_bread(inode->i_sb, level_bno);
+	if (!bh_index)
+		return -EIO;
+	raw = (__le32 *)bh_index->b_data;
 
-		ret = -EIO;
-		goto out;
+	if (!map) {
+		ret = ouichefs_flat_lookup_raw(raw, idx, max_blocks, bno);
+		if (*bno || !create)
+			goto brelse_index;
 	}
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
-	while (count > 0) {
-		/* Calculate which block and offset within block */
-		sector_t block_idx = pos / OUICHEFS_BLOCK_SIZE;
-		size_t block_offset = pos % OUICHEFS_BLOCK_SIZE;
-		size_t to_read = min(count, OUICHEFS_BLOCK_SIZE - block_offset);
-		uint32_t physical_block;
+	ret = ouichefs_flat_alloc(OUICHEFS_SB(inode->i_sb), map, raw, idx, ret,
+				  bno, flags);
+	if (ret > 0) {
+		/*
+		 * Attach the index block to the inode so that fsync() flushes
+		 * it along with the data (see sync_mapping_buffers()).
+		 */
+		mark_buffer_dirty_inode(bh_index, inode);
+		*new = true;
+	}
 
-		/* Check if block index is valid */
-		if (block_idx >= OUICHEFS_BLOCK_SIZE >> 2) {
-			ret = -EFBIG;
-			goto out;
-		}
+brelse_index:
+	brelse(bh_index);
 
-		/* Get physical block number */
-		physical_block = le32_to_cpu(index->blocks[block_idx]);
-		if (physical_block == 0) {
-			/* Unallocated block - fill with zeros */
-			if (iov_iter_zero(to_read, to) != to_read) {
-				ret = -EFAULT;
-				goto out;
-			}
-		} else {
-			/* Read from allocated block */
-			bh_data = sb_bread(sb, physical_block);
-			if (!bh_data) {
-				pr_err("%s: failed to read data block %u\n",
-				       __func__, physical_block);
-				ret = -EIO;
-				goto out;
-			}
+	return ret;
+}
 
-			/* Copy data to user space */
-			if (copy_to_iter(bh_data->b_data + block_offset,
-					 to_read, to) != to_read) {
-				brelse(bh_data);
-				ret = -EFAULT;
-				goto out;
-			}
+/*
+ * Allocate an empty index block and store it in the slot-th entry of the index
+ * block parent_bno (and of its cached copy parent).
+ */
+static int ouichefs_add_index_block(struct inode *inode, uint32_t *parent,
+				    uint32_t parent_bno, uint32_t slot)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh_parent;
+	uint32_t bno;
+	int ret;
 
-			brelse(bh_data);
-			bh_data = NULL;
-		}
+	bh_parent = sb_bread(sb, parent_bno);
+	if (!bh_parent)
+		return -EIO;
 
-		/* Update counters */
-		pos += to_read;
-		count -= to_read;
-		copied += to_read;
+	bno = get_reserved_block(OUICHEFS_SB(sb));
+	if (!bno) {
+		ret = -ENOSPC;
+		goto brelse_parent;
+	}
+	ret = ouichefs_zero_index_block(inode, bno);
+	if (ret) {
+		put_block(OUICHEFS_SB(sb), bno);
+		goto brelse_parent;
 	}
 
-	/* Update file position */
-	iocb->ki_pos = pos;
-	ret = copied;
-
-out:
-	pr_info("at out section\n");
-	pr_info("bh_index: %p, bh_data: %p, ret: %ld\n", bh_index, bh_data,
-		ret);
+	((__le32 *)bh_parent->b_data)[slot] = cpu_to_le32(bno);
+	parent[slot] = bno;
+	mark_buffer_dirty_inode(bh_parent, inode);
 
-	if (bh_index)
-		brelse(bh_index);
-	if (bh_data)
-		brelse(bh_data);
+brelse_parent:
+	brelse(bh_parent);
 
 	return ret;
 }
 
-static struct buffer_head *init_slice_block(struct super_block *sb,
-					    uint32_t block)
+/*
+ * Return the cached copy of the indirect block referenced by the slot-th entry
+ * of the index block, reading it on first use (and allocating it if create is
+ * true). Return NULL if there is no such block.
+ */
+static uint32_t *ouichefs_get_indirect(struct inode *inode, uint32_t *map,
+				       uint32_t slot, uint32_t **cache,
+				       bool create)
 {
-	uint32_t physical_block = le32_to_cpu(block);
-	if (physical_block == 0) {
-		pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
-		dump_stack();
-	}
-	struct buffer_head *bh_data = sb_bread(sb, physical_block);
-	if (!bh_data) {
-		return NULL;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t *level;
+	int ret;
+
+	if (*cache)
+		return *cache;
+
+	if (!map[slot]) {
+		if (!create)
+			return NULL;
+		ret = ouichefs_add_index_block(inode, map, ci->index_block,
+					       slot);
+		if (ret)
+			return ERR_PTR(ret);
 	}
 
-	/* initialie metadata */
-	bh_data->b_data[0] = (char)~(0b1);
-	bh_data->b_data[1] = (char)~0;
-	bh_data->b_data[2] = (char)~0;
-	bh_data->b_data[3] = (char)~0;
+	level = ouichefs_read_index(inode->i_sb, map[slot]);
+	if (!IS_ERR(level))
+		*cache = level;
 
-	return bh_data;
+	return level;
 }
 
-static ssize_t allocate_and_init_slice_block(struct super_block *sb,
-					     struct ouichefs_sb_info *sbi,
-					     struct buffer_head **bh_data)
+/*
+ * Flat index: map blocks through the direct entries of the index block, then
+ * through its single and double indirect blocks. The index block and the
+ * first two indirect levels are cached, so a lookup reads at most one block
+ * (a double indirect leaf).
+ */
+static int ouichefs_flat_map(struct inode *inode, uint32_t *map,
+			     uint32_t iblock, uint32_t max_blocks,
+			     uint32_t *bno, unsigned int flags, bool *new)
 {
-	uint32_t free_block = get_free_block(sbi);
-	if (!free_block || free_block > (1 << 27)) {
-		pr_err("Failed to allocate sliced block. free_block: %u\n",
-		       free_block);
-		put_block(sbi, free_block);
-		return -ENOSPC;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	bool create = flags & OUICHEFS_MAP_CREATE;
+	uint32_t *level, leaf;
+	int ret;
+
+	if (iblock < OUICHEFS_INDEX_DIRECT)
+		return ouichefs_flat_map_level(
+			inode, map, ci->index_block, iblock,
+			min(max_blocks, OUICHEFS_INDEX_DIRECT - iblock), bno,
+			flags, new);
+
+	iblock -= OUICHEFS_INDEX_DIRECT;
+	if (iblock < OUICHEFS_INDEX_ENTRIES) {
+		max_blocks = min(max_blocks, OUICHEFS_INDEX_ENTRIES - iblock);
+		level = ouichefs_get_indirect(inode, map, OUICHEFS_INDEX_IND,
+					      &ci->ind_map, create);
+		if (IS_ERR(level))
+			return PTR_ERR(level);
+		if (!level) {
+			*bno = 0;
+			return max_blocks;
+		}
+		return ouichefs_flat_map_level(inode, level,
+					       map[OUICHEFS_INDEX_IND], iblock,
+					       max_blocks, bno, flags, new);
 	}
-	*bh_data = init_slice_block(sb, free_block);
 
-	if (!*bh_data) {
-		pr_err("Failed to initialize sliced block\n");
-		put_block(sbi, free_block);
-		return -EIO;
+	iblock -= OUICHEFS_INDEX_ENTRIES;
+	leaf = iblock / OUICHEFS_INDEX_ENTRIES;
+	iblock %= OUICHEFS_INDEX_ENTRIES;
+	max_blocks = min(max_blocks, OUICHEFS_INDEX_ENTRIES - iblock);
+	level = ouichefs_get_indirect(inode, map, OUICHEFS_INDEX_DIND,
+				      &ci->dind_map, create);
+	if (IS_ERR(level))
+		return PTR_ERR(level);
+	if (level && !level[leaf] && create) {
+		ret = ouichefs_add_index_block(inode, level,
+					       map[OUICHEFS_INDEX_DIND], leaf);
+		if (ret)
+			return ret;
+	}
+	if (!level || !level[leaf]) {
+		*bno = 0;
+		return max_blocks;
 	}
 
-	sbi->nr_sliced_blocks++;
+	return ouichefs_flat_map_level(inode, NULL, level[leaf], iblock,
+				       max_blocks, bno, flags, new);
+}
 
-	pr_info("Allocated new sliced block: %u. num sliced blocks: %u\n",
-		free_block, sbi->nr_sliced_blocks);
+/* Flat index: free the blocks listed in the index block bno */
+static void ouichefs_flat_free_level(struct super_block *sb, uint32_t bno)
+{
+	struct ouichefs_free_run run = { 0 };
+	struct buffer_head *bh_index;
+	__le32 *raw;
+	int i;
 
-	return (ssize_t)free_block;
+	bh_index = sb_bread(sb, bno);
+	if (!bh_index)
+		return;
+	raw = (__le32 *)bh_index->b_data;
+	for (i = 0; i < OUICHEFS_INDEX_ENTRIES; i++)
+		ouichefs_free_run_add(OUICHEFS_SB(sb), &run,
+				      le32_to_cpu(raw[i]));
+	ouichefs_free_run_flush(OUICHEFS_SB(sb), &run);
+	brelse(bh_index);
 }
 
-static bool is_new(uint32_t index_block)
+/*
+ * Flat index: free all the data blocks and the indirect blocks. The cached
+ * indirect levels are dropped, the caller empties map.
+ */
+static void ouichefs_flat_free(struct inode *inode, uint32_t *map)
 {
-	return index_block == 0;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_free_run run = { 0 };
+	uint32_t *level;
+	int i;
+
+	for (i = 0; i < OUICHEFS_INDEX_DIRECT; i++)
+		ouichefs_free_run_add(OUICHEFS_SB(sb), &run, map[i]);
+	ouichefs_free_run_flush(OUICHEFS_SB(sb), &run);
+
+	if (map[OUICHEFS_INDEX_IND]) {
+		ouichefs_flat_free_level(sb, map[OUICHEFS_INDEX_IND]);
+		ouichefs_free_index_block(sb, map[OUICHEFS_INDEX_IND]);
+	}
+
+	if (map[OUICHEFS_INDEX_DIND]) {
+		level = ouichefs_get_indirect(inode, map, OUICHEFS_INDEX_DIND,
+					      &ci->dind_map, false);
+		for (i = 0; !IS_ERR(level) && i < OUICHEFS_INDEX_ENTRIES; i++) {
+			if (!level[i])
+				continue;
+			ouichefs_flat_free_level(sb, level[i]);
+			ouichefs_free_index_block(sb, level[i]);
+		}
+		ouichefs_free_index_block(sb, map[OUICHEFS_INDEX_DIND]);
+	}
+
+	kfree(ci->ind_map);
+	kfree(ci->dind_map);
+	ci->ind_map = NULL;
+	ci->dind_map = NULL;
 }
 
-static bool will_be_small(loff_t new_size)
+/*
+ * Return the new value of the index entry of a block being punched (the block
+ * is added to run, to be freed) or written (it is no longer unwritten).
+ */
+static uint32_t ouichefs_update_entry(struct ouichefs_sb_info *sbi,
+				      struct ouichefs_free_run *run,
+				      uint32_t entry, bool punch)
 {
-	return new_size <= OUICHEFS_BLOCK_SIZE - OUICHEFS_SLICE_SIZE;
+	if (!punch)
+		return entry & ~OUICHEFS_UNWRITTEN;
+
+	ouichefs_free_run_add(sbi, run, entry);
+	return 0;
 }
 
-static ssize_t write_big_file(struct inode *inode,
-			      struct ouichefs_inode_info *ci,
-			      struct super_block *sb,
-			      struct ouichefs_sb_info *sbi, struct kiocb *iocb,
-			      struct iov_iter *from);
+/*
+ * Flat index: update the nr entries from the idx-th one of the index block
+ * level_bno (and of its cached copy map, if any), see ouichefs_update_entry().
+ */
+static int ouichefs_flat_update_level(struct inode *inode, uint32_t *map,
+				      uint32_t level_bno, uint32_t idx,
+				      uint32_t nr, bool punch)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_free_run run = { 0 };
+	struct buffer_head *bh_index;
+	bool changed = false;
+	__le32 *raw;
+	uint32_t i, entry;
 
-static ssize_t write_small_file(struct inode *inode,
-				struct ouichefs_inode_info *ci,
-				struct super_block *sb,
-				struct ouichefs_sb_info *sbi,
-				struct kiocb *iocb, struct iov_iter *from);
+	bh_index = sb_bread(inode->i_sb, level_bno);
+	if (!bh_index)
+		return -EIO;
+	raw = (__le32 *)bh_index->b_data;
+
+	for (i = idx; i < idx + nr; i++) {
+		if (!raw[i])
+			continue;
+		entry = ouichefs_update_entry(sbi, &run, le32_to_cpu(raw[i]),
+					      punch);
+		raw[i] = cpu_to_le32(entry);
+		if (map)
+			map[i] = entry;
+		changed = true;
+	}
+	ouichefs_free_run_flush(sbi, &run);
+	if (changed)
+		mark_buffer_dirty_inode(bh_index, inode);
+	brelse(bh_index);
 
-static ssize_t delete_slice(struct super_block *sb,
-			    struct ouichefs_sb_info *sbi, uint32_t bno,
-			    uint32_t slice_no, uint32_t num_slices)
+	return 0;
+}
+
+/*
+ * Flat index: update the nr blocks from iblock (relative to the index block),
+ * through the same levels as ouichefs_flat_map(). Missing indirect blocks are
+ * holes, there is nothing to update there.
+ */
+static int ouichefs_flat_update(struct inode *inode, uint32_t *map,
+				uint32_t iblock, uint32_t nr, bool punch)
 {
-	/* Check if this small file actually has any data written to it */
-	if (bno == 0)
-		return 0;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t *level, idx, leaf, len;
+	int ret = 0;
+
+	while (nr) {
+		if (iblock < OUICHEFS_INDEX_DIRECT) {
+			len = min(nr, OUICHEFS_INDEX_DIRECT - iblock);
+			ret = ouichefs_flat_update_level(inode, map,
+							 ci->index_block,
+							 iblock, len, punch);
+		} else if (iblock - OUICHEFS_INDEX_DIRECT <
+			   OUICHEFS_INDEX_ENTRIES) {
+			idx = iblock - OUICHEFS_INDEX_DIRECT;
+			len = min(nr, OUICHEFS_INDEX_ENTRIES - idx);
+			level = ouichefs_get_indirect(inode, map,
+						      OUICHEFS_INDEX_IND,
+						      &ci->ind_map, false);
+			if (IS_ERR(level))
+				return PTR_ERR(level);
+			if (level)
+				ret = ouichefs_flat_update_level(
+					inode, level, map[OUICHEFS_INDEX_IND],
+					idx, len, punch);
+		} else {
+			idx = iblock - OUICHEFS_INDEX_DIRECT -
+			      OUICHEFS_INDEX_ENTRIES;
+			leaf = idx / OUICHEFS_INDEX_ENTRIES;
+			idx %= OUICHEFS_INDEX_ENTRIES;
+			len = min(nr, OUICHEFS_INDEX_ENTRIES - idx);
+			level = ouichefs_get_indirect(inode, map,
+						      OUICHEFS_INDEX_DIND,
+						      &ci->dind_map, false);
+			if (IS_ERR(level))
+				return PTR_ERR(level);
+			if (level && level[leaf])
+				ret = ouichefs_flat_update_level(
+					inode, NULL, level[leaf], idx, len,
+					punch);
+		}
+		if (ret)
+			return ret;
+		iblock += len;
+		nr -= len;
+	}
 
-	if (num_slices == 0) {
-		pr_err("num_slices is 0. BAD!\n");
-		return 0;
+	return 0;
+}
+
+/* Extent index: number of blocks of e, without its unwritten flag */
+static uint32_t ouichefs_ext_len(struct ouichefs_mem_extent *e)
+{
+	return e->len & ~OUICHEFS_UNWRITTEN;
+}
+
+/*
+ * Extent index: find the extent containing iblock. Return the length of the
+ * mapped run (or of the hole) starting at iblock and store in *idx the index
+ * of the extent containing iblock, or of the first extent after it.
+ */
+static uint32_t ouichefs_extent_lookup(struct ouichefs_extent_map *emap,
+				       uint32_t iblock, uint32_t max_blocks,
+				       uint32_t *bno, uint32_t *idx)
+{
+	struct ouichefs_mem_extent *e;
+	uint32_t lo = 0, hi = emap->nr_extents, mid;
+
+	/* First extent ending after iblock */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &emap->extents[mid];
+		if (e->block + ouichefs_ext_len(e) <= iblock)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	struct buffer_head *bh = NULL;
+	*idx = lo;
 
-	if (bno == 0) {
-		pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
-		dump_stack();
+	if (lo == emap->nr_extents) {
+		*bno = 0;
+		return max_blocks;
 	}
-	bh = sb_bread(sb, bno);
-	if (!bh) {
-		pr_err("cannot read slice block %u\n", bno);
-		return -EIO;
+
+	e = &emap->extents[lo];
+	if (e->block > iblock) {
+		*bno = 0;
+		return min(max_blocks, e->block - iblock);
 	}
 
-	uint32_t mask = ((1U << num_slices) - 1) << (slice_no);
+	*bno = (e->start + (iblock - e->block)) | (e->len & OUICHEFS_UNWRITTEN);
+	return min(max_blocks, ouichefs_ext_len(e) - (iblock - e->block));
+}
 
-	/* Mark the slices the file used as free*/
-	*(uint32_t *)bh->b_data |= mask;
+/*
+ * Extent index: allocate the hole of hole_len blocks at iblock, before the
+ * idx-th extent. The new blocks extend the previous extent when they follow
+ * it on disk, so a file written sequentially keeps a single extent.
+ */
+static int ouichefs_extent_alloc(struct ouichefs_sb_info *sbi,
+				 struct ouichefs_extent_map *emap,
+				 uint32_t iblock, uint32_t hole_len,
+				 uint32_t idx, uint32_t *bno, unsigned int flags)
+{
+	uint32_t state = flags & OUICHEFS_MAP_UNWRITTEN ? OUICHEFS_UNWRITTEN : 0;
+	struct ouichefs_mem_extent *prev = NULL, *next = NULL;
+	uint32_t goal = 0, len, i;
 
-	/* Zero out the slices for the small file */
-	memset(bh->b_data + slice_no * OUICHEFS_SLICE_SIZE, 0,
-	       num_slices * OUICHEFS_SLICE_SIZE);
+	if (idx > 0)
+		prev = &emap->extents[idx - 1];
+	if (idx < emap->nr_extents)
+		next = &emap->extents[idx];
 
-	pr_info("Deleting slice %u from block %u, num_slices: %u\n", slice_no,
-		bno, num_slices);
-	sbi->nr_used_slices -= num_slices;
-	pr_info("sbi->nr_used_slices: %u\n", sbi->nr_used_slices);
+	if (prev && prev->block + ouichefs_ext_len(prev) == iblock)
+		goal = prev->start + ouichefs_ext_len(prev);
 
-	mark_buffer_dirty(bh);
-	brelse(bh);
-	bh = NULL;
-
-	/* Iterate over all sliced block
-	   Check if blocks are empty and if so free and repoint pointers
-	*/
-	uint32_t current_bno = sbi->s_free_sliced_blocks;
-	struct buffer_head *bh_prev = NULL;
-	while (current_bno) {
-		pr_info("current_bno: %u\n", current_bno);
-		/* Read next sliced block */
-		bh = sb_bread(sb, current_bno);
-		if (!bh) {
-			pr_err("Failed to read next sliced block %u\n",
-			       current_bno);
-			brelse(bh_prev);
-			return -EIO;
-		}
+	len = ouichefs_alloc_run(sbi, goal, hole_len, bno);
+	if (!len)
+		return -ENOSPC;
 
-		/* Fetch next_bno now (we might scrub the block later)*/
-		uint32_t next_bno = OUICHEFS_SLICED_BLOCK_SB_NEXT(bh);
-
-		/* Check if block is free */
-		if (OUICHEFS_BITMAP_IS_ALL_FREE(bh)) {
-			pr_info("sliced block %llu is completely free, freeing it\n",
-				bh->b_blocknr);
-
-			/* Repoint "pointers" */
-			if (bh_prev) {
-				OUICHEFS_SLICED_BLOCK_SB_SET_NEXT(bh_prev,
-								  next_bno);
-				pr_info("Setting next_bno %u in previous block %llu\n",
-					next_bno, bh_prev->b_blocknr);
-				mark_buffer_dirty(bh_prev);
-			} else {
-				pr_info("No previous sliced block, setting s_free_sliced_blocks to %u\n",
-					next_bno);
-				sbi->s_free_sliced_blocks = next_bno;
-			}
+	/* Only extents in the same state can be merged */
+	if (prev && (prev->len & OUICHEFS_UNWRITTEN) != state)
+		prev = NULL;
+	if (next && (next->len & OUICHEFS_UNWRITTEN) != state)
+		next = NULL;
+
+	if (prev && prev->block + ouichefs_ext_len(prev) == iblock &&
+	    prev->start + ouichefs_ext_len(prev) == *bno) {
+		prev->len += len;
+		/* The hole is filled, merge with the next extent if possible */
+		if (next && prev->block + ouichefs_ext_len(prev) == next->block &&
+		    prev->start + ouichefs_ext_len(prev) == next->start) {
+			prev->len += ouichefs_ext_len(next);
+			memmove(next, next + 1,
+				(emap->nr_extents - idx - 1) * sizeof(*next));
+			emap->nr_extents--;
+		}
+	} else if (next && iblock + len == next->block &&
+		   *bno + len == next->start) {
+		next->block = iblock;
+		next->start = *bno;
+		next->len += len;
+	} else {
+		if (emap->nr_extents == OUICHEFS_EXTENTS_PER_BLOCK) {
+			put_blocks(sbi, *bno, len);
+			return -ENOSPC;
+		}
+		memmove(&emap->extents[idx + 1], &emap->extents[idx],
+			(emap->nr_extents - idx) * sizeof(*next));
+		emap->extents[idx].block = iblock;
+		emap->extents[idx].start = *bno;
+		emap->extents[idx].len = len | state;
+		emap->nr_extents++;
+	}
 
-			/* Cleanup bh */
-			sbi->nr_sliced_blocks--;
-			pr_info("sbi->nr_sliced_blocks: %u\n",
-				sbi->nr_sliced_blocks);
-			memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
-			put_block(sbi, bh->b_blocknr);
-			mark_buffer_dirty(bh);
-			brelse(bh);
-			bh = NULL;
-		} else {
-			/* Sliced block not empty, go to next */
-			pr_info("sliced block %llu is not empty, keeping it\n",
-				bh->b_blocknr);
-
-			/* Release reference to previous block (if there is one) */
-			if (bh_prev) {
-				brelse(bh_prev);
-				bh_prev = NULL;
-			}
+	*bno |= state;
+	return len;
+}
 
-			bh_prev = bh;
-			bh = NULL;
+/*
+ * Extent index: append an extent to emap, merging it with the last one when
+ * both are contiguous in the file and on disk, and in the same state.
+ */
+static void ouichefs_extent_append(struct ouichefs_extent_map *emap,
+				   uint32_t block, uint32_t start, uint32_t len)
+{
+	struct ouichefs_mem_extent *last;
+
+	if (emap->nr_extents) {
+		last = &emap->extents[emap->nr_extents - 1];
+		if ((last->len & OUICHEFS_UNWRITTEN) ==
+			    (len & OUICHEFS_UNWRITTEN) &&
+		    last->block + ouichefs_ext_len(last) == block &&
+		    last->start + ouichefs_ext_len(last) == start) {
+			last->len += len & ~OUICHEFS_UNWRITTEN;
+			return;
 		}
-		current_bno = next_bno;
 	}
 
-	pr_info("at end: bh: %p, bh_prev: %p\n", bh, bh_prev);
+	last = &emap->extents[emap->nr_extents++];
+	last->block = block;
+	last->start = start;
+	last->len = len;
+}
+
+/*
+ * Extent index: punch the nr blocks from iblock out of emap (their blocks are
+ * freed), or mark them written. The extents overlapping the range are split,
+ * which fails with -ENOSPC if the extent block is full. Nothing is changed
+ * then.
+ */
+static int ouichefs_extent_update(struct ouichefs_sb_info *sbi,
+				  struct ouichefs_extent_map *emap,
+				  uint32_t iblock, uint32_t nr, bool punch)
+{
+	struct ouichefs_extent_map *new;
+	struct ouichefs_mem_extent *e;
+	uint32_t end = iblock + nr, from, to, len, state, i;
+
+	/* Only the first and last extents of the range can be split */
+	new = kmalloc(sizeof(*new) + 2 * sizeof(*e), GFP_NOFS);
+	if (!new)
+		return -ENOMEM;
+	new->nr_extents = 0;
+
+	for (i = 0; i < emap->nr_extents; i++) {
+		e = &emap->extents[i];
+		len = ouichefs_ext_len(e);
+		state = e->len & OUICHEFS_UNWRITTEN;
+		from = max(e->block, iblock);
+		to = min(e->block + len, end);
+		if (from >= to) {
+			ouichefs_extent_append(new, e->block, e->start, e->len);
+			continue;
+		}
+		if (e->block < from)
+			ouichefs_extent_append(new, e->block, e->start,
+					       (from - e->block) | state);
+		if (!punch)
+			ouichefs_extent_append(new, from,
+					       e->start + (from - e->block),
+					       to - from);
+		if (to < e->block + len)
+			ouichefs_extent_append(new, to,
+					       e->start + (to - e->block),
+					       (e->block + len - to) | state);
+	}
 
-	if (bh) {
-		brelse(bh);
-		bh = NULL;
+	if (new->nr_extents > OUICHEFS_EXTENTS_PER_BLOCK) {
+		kfree(new);
+		return -ENOSPC;
 	}
-	if (bh_prev) {
-		brelse(bh_prev);
-		bh_prev = NULL;
+
+	for (i = 0; punch && i < emap->nr_extents; i++) {
+		e = &emap->extents[i];
+		from = max(e->block, iblock);
+		to = min(e->block + ouichefs_ext_len(e), end);
+		if (from < to)
+			put_blocks(sbi, e->start + (from - e->block), to - from);
 	}
 
+	/* Stale extents past the end would be written back to disk, clear them */
+	memcpy(emap->extents, new->extents,
+	       new->nr_extents * sizeof(*e));
+	if (new->nr_extents < emap->nr_extents)
+		memset(&emap->extents[new->nr_extents], 0,
+		       (emap->nr_extents - new->nr_extents) * sizeof(*e));
+	emap->nr_extents = new->nr_extents;
+	kfree(new);
+
 	return 0;
 }
 
-ssize_t delete_slice_and_clear_inode(struct ouichefs_inode_info *ci,
-				     struct super_block *sb,
-				     struct ouichefs_sb_info *sbi)
+/*
+ * Map up to max_blocks blocks from the iblock-th one through the direct block
+ * pointers of the inode, allocating them if create is true. The inode is
+ * written back by the VFS.
+ */
+static int ouichefs_direct_map(struct inode *inode, uint32_t iblock,
+			       uint32_t max_blocks, uint32_t *bno,
+			       unsigned int flags, bool *new)
 {
-	ssize_t ret = 0;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t goal = 0, len, i;
 
-	pr_info("inode index_block: %u, bno %u and slice_no %u\n",
-		OUICHEFS_INODE(&ci->vfs_inode)->index_block,
-		OUICHEFS_SMALL_FILE_GET_BNO(ci),
-		OUICHEFS_SMALL_FILE_GET_SLICE(ci));
-	uint32_t bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
-	uint32_t slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
-	uint32_t num_slices = ci->num_slices;
-	ret = delete_slice(sb, sbi, bno, slice_no, num_slices);
-	if (ret < 0) {
-		pr_err("Failed to delete slice: %zd\n", ret);
-		return ret;
-	}
+	len = ouichefs_flat_lookup(ci->i_direct, iblock, max_blocks, bno);
+	if (*bno || !(flags & OUICHEFS_MAP_CREATE))
+		return len;
 
-	pr_info("Slice deleted successfully\n\n");
+	if (iblock && ci->i_direct[iblock - 1])
+		goal = (ci->i_direct[iblock - 1] & ~OUICHEFS_UNWRITTEN) + 1;
 
-	/* Reset index block */
-	ci->index_block = 0;
-	ci->vfs_inode.i_size = 0;
+	len = ouichefs_alloc_run(OUICHEFS_SB(inode->i_sb), goal, len, bno);
+	if (!len)
+		return -ENOSPC;
 
-	mark_inode_dirty(&ci->vfs_inode);
+	if (flags & OUICHEFS_MAP_UNWRITTEN)
+		*bno |= OUICHEFS_UNWRITTEN;
+	for (i = 0; i < len; i++)
+		ci->i_direct[iblock + i] = *bno + i;
+	mark_inode_dirty(inode);
+	*new = true;
+
+	return len;
+}
+
+/*
+ * Allocate the index block of a file that outgrew its direct block pointers.
+ * The block and the in-memory block map are both initialized empty. The
+ * caller holds ci->block_map_lock.
+ */
+static int ouichefs_new_block_map(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t bno, *map;
+	int ret;
+
+	map = kcalloc(OUICHEFS_INDEX_ENTRIES, sizeof(*map), GFP_NOFS);
+	if (!map)
+		return -ENOMEM;
+
+	bno = get_reserved_block(sbi);
+	if (!bno) {
+		pr_err("Failed to allocate index block\n");
+		kfree(map);
+		return -ENOSPC;
+	}
+
+	ret = ouichefs_zero_index_block(inode, bno);
+	if (ret) {
+		put_block(sbi, bno);
+		kfree(map);
+		return ret;
+	}
+
+	kfree(ci->block_map);
+	kfree(ci->ind_map);
+	kfree(ci->dind_map);
+	ci->block_map = map;
+	ci->ind_map = NULL;
+	ci->dind_map = NULL;
+	ci->index_block = bno;
+	mark_inode_dirty(inode);
 
 	return 0;
 }
 
-/* TODO: This function reads the data in the small file's slice, combines it with input from user-space and writes it using write_big_file(). I write big file fails, the small slice will still be removed! 
-Solution 1: Dont care.
-Solution 2: put necessary funtionality from delete_slice() in here (ugly but should work) */
-static ssize_t convert_small_to_big(struct kiocb *iocb, struct iov_iter *from)
+/*
+ * Map up to max_blocks blocks of the file represented by inode, starting at
+ * the iblock-th block. On success, return the length of the run starting at
+ * iblock and store its first physical block in *bno:
+ *   - for allocated blocks, the run covers physically contiguous blocks in
+ *     the same state, *bno has OUICHEFS_UNWRITTEN set if they are unwritten;
+ *   - for holes, *bno is 0 and the run covers the whole hole, unless flags
+ *     has OUICHEFS_MAP_CREATE, in which case the hole is allocated (as
+ *     contiguously as the free block bitmap allows) and *new is set.
+ * Lookups only use the in-memory block map, the index block is read only on
+ * first use and when blocks are allocated.
+ * Return a negative error code on failure.
+ */
+static int ouichefs_map_blocks(struct inode *inode, uint32_t iblock,
+			       uint32_t max_blocks, uint32_t *bno,
+			       unsigned int flags, bool *new)
 {
-	struct file *file = iocb->ki_filp;
-	struct inode *inode = file_inode(file);
+	bool create = flags & OUICHEFS_MAP_CREATE;
 	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	loff_t pos = iocb->ki_pos;
-	loff_t count = iov_iter_count(from);
+	uint32_t nr_iblocks = sb->s_maxbytes >> inode->i_blkbits;
+	struct buffer_head *bh_index;
+	uint32_t len, idx = 0, *map, meta = 0;
+	int ret, claimed = 0;
 
-	/*	Stor old data about the file incase we fail to write a big one */
-	loff_t old_size = inode->i_size;
-	uint32_t old_index_block = ci->index_block;
-	loff_t old_pos = pos;
-	pr_info("Converting small file to big file. count: %lld, pos: %lld, inode->i_size: %lld\n",
-		count, pos, inode->i_size);
+	/* Small files live in a slice, they have no block map */
+	if (WARN_ON_ONCE(!inode->i_blocks))
+		return -EIO;
 
-	ssize_t ret = 0;
-	char *combined_buf = NULL;
-	struct kvec *kv = NULL;
-	struct iov_iter new_iter;
-	loff_t write_pos = pos;
-	struct buffer_head *bh_data = NULL;
+	/* If block number exceeds filesize, fail */
+	if (iblock >= nr_iblocks)
+		return -EFBIG;
+	max_blocks = min(max_blocks, nr_iblocks - iblock);
 
-	if (iocb->ki_flags & IOCB_APPEND) {
-		write_pos = old_size;
+	/*
+	 * Allocations not covered by the reservations of delayed blocks reserve
+	 * what they may take first, so that they leave those alone. Without
+	 * room, the blocks can still be mapped if they are already allocated.
+	 */
+	if (create && !(flags & OUICHEFS_MAP_DELALLOC)) {
+		if (iblock + max_blocks > OUICHEFS_NR_DIRECT_BLOCKS)
+			meta = ouichefs_meta_blocks(sbi, max_blocks);
+		claimed = reserve_some_blocks(sbi, meta, max_blocks);
+		if (claimed < 0) {
+			ret = ouichefs_map_blocks(inode, iblock, max_blocks,
+						  bno, 0, new);
+			return ret > 0 && !*bno ? -ENOSPC : ret;
+		}
+		max_blocks = claimed;
 	}
 
-	/* Always read the existing small file data first */
-	uint32_t bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
-	if (bno == 0) {
-		pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
-		dump_stack();
-	}
-	bh_data = sb_bread(sb, bno);
-	if (!bh_data) {
-		pr_err("Failed to read sliced block %u\n", bno);
-		ret = -EIO;
-		goto out;
-	}
+	mutex_lock(&ci->block_map_lock);
 
-	/* Calculate the total size of the new file */
-	size_t new_file_size = max(write_pos + count, old_size);
+	/* The first blocks are mapped by the inode itself */
+	if (iblock < OUICHEFS_NR_DIRECT_BLOCKS) {
+		ret = ouichefs_direct_map(
+			inode, iblock,
+			min(max_blocks, OUICHEFS_NR_DIRECT_BLOCKS - iblock),
+			bno, flags, new);
+		goto unlock;
+	}
 
-	/* Allocate buffer for the entire new file content */
-	combined_buf = kmalloc(new_file_size, GFP_KERNEL);
-	if (!combined_buf) {
-		brelse(bh_data);
-		ret = -ENOMEM;
-		goto out;
+	/* The index block is only allocated once the file outgrows them */
+	if (!ci->index_block) {
+		if (!create) {
+			*bno = 0;
+			ret = max_blocks;
+			goto unlock;
+		}
+		ret = ouichefs_new_block_map(inode);
+		if (ret)
+			goto unlock;
 	}
 
-	uint32_t slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
+	map = ouichefs_get_block_map(inode);
+	if (IS_ERR(map)) {
+		ret = PTR_ERR(map);
+		goto unlock;
+	}
 
-	/* Copy existing file data to the beginning of the buffer */
-	memcpy(combined_buf, bh_data->b_data + slice_no * OUICHEFS_SLICE_SIZE,
-	       old_size);
-	brelse(bh_data);
+	if (!OUICHEFS_HAS_EXTENTS(sbi)) {
+		ret = ouichefs_flat_map(inode, map,
+					iblock - OUICHEFS_NR_DIRECT_BLOCKS,
+					max_blocks, bno, flags, new);
+		goto unlock;
+	}
 
-	/* Zero-fill any gap between old data and write position */
-	if (write_pos > old_size) {
-		memset(combined_buf + old_size, 0, write_pos - old_size);
+	len = ouichefs_extent_lookup((struct ouichefs_extent_map *)map, iblock,
+				     max_blocks, bno, &idx);
+	if (*bno || !create) {
+		ret = len;
+		goto unlock;
 	}
 
-	/* Copy new data from user space into the buffer */
-	size_t copied = copy_from_iter(combined_buf + write_pos, count, from);
-	if (copied != count) {
-		pr_err("Failed to copy user data from iterator\n");
-		ret = -EFAULT;
-		goto out;
+	/* Allocate the hole, the index block is updated along with the map */
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto unlock;
 	}
 
-	/* Create kvec and iterator for the entire new file content */
-	kv = kmalloc(sizeof(struct kvec), GFP_KERNEL);
-	if (!kv) {
-		ret = -ENOMEM;
-		goto out;
+	ret = ouichefs_extent_alloc(sbi, (struct ouichefs_extent_map *)map,
+				    iblock, len, idx, bno, flags);
+	if (ret > 0) {
+		ouichefs_sync_block_map(inode, map, bh_index);
+		*new = true;
 	}
-	kv->iov_base = combined_buf;
-	kv->iov_len = new_file_size;
+	brelse(bh_index);
 
-	/* Create iterator that contains the complete new file */
-	iov_iter_kvec(&new_iter, READ, kv, 1, new_file_size);
-	new_iter.data_source = 1;
+unlock:
+	mutex_unlock(&ci->block_map_lock);
+	if (claimed > 0)
+		unreserve_blocks(sbi, meta + claimed);
 
-	/* Reset inode size to 0 since we're creating a new file */
-	inode->i_size = 0;
+	return ret;
+}
+
+/*
+ * Update the nr blocks of the file from iblock: with punch, free them and
+ * leave a hole, otherwise mark the unwritten ones as written. Delayed blocks
+ * are not affected, the caller handles their reservations.
+ */
+static int ouichefs_update_blocks(struct inode *inode, uint32_t iblock,
+				  uint32_t nr, bool punch)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_free_run run = { 0 };
+	uint32_t end = iblock + nr, *map;
+	struct buffer_head *bh_index;
+	int ret = 0;
 
-	/* Reset position to 0 and remove append flag - we're writing entire file */
-	struct kiocb new_iocb = *iocb;
-	new_iocb.ki_pos = 0;
-	new_iocb.ki_flags &= ~IOCB_APPEND;
+	mutex_lock(&ci->block_map_lock);
 
-	/* Write the entire new file content */
-	ret = write_big_file(inode, ci, sb, sbi, &new_iocb, &new_iter);
+	if (iblock < OUICHEFS_NR_DIRECT_BLOCKS) {
+		for (; iblock < min_t(uint32_t, end, OUICHEFS_NR_DIRECT_BLOCKS);
+		     iblock++)
+			ci->i_direct[iblock] = ouichefs_update_entry(
+				sbi, &run, ci->i_direct[iblock], punch);
+		ouichefs_free_run_flush(sbi, &run);
+		mark_inode_dirty(inode);
+	}
+	if (iblock >= end || !ci->index_block)
+		goto unlock;
 
-	if (ret > 0) {
-		/* Update the original iocb position to reflect the write position */
-		iocb->ki_pos = write_pos + count;
-		/* Return the number of bytes actually written by the user */
-		ret = count;
-
-		/* We ignore the return value of deleting the slice here. If data is lost then so be it.*/
-		if (OUICHEFS_SMALL_FILE_GET_BNO(ci)) {
-			pr_err("bno is 0");
-		}
-		uint32_t bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
-		uint32_t slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
-		uint32_t num_slices = ci->num_slices;
-		ret = delete_slice(sb, sbi, bno, slice_no, num_slices);
-	} else {
-		pr_err("Failed to write big file: %zd\n", ret);
-		/* If writing failed, restore the old inode */
-		ci->index_block = old_index_block;
-		inode->i_size = old_size;
-		iocb->ki_pos = old_pos;
+	map = ouichefs_get_block_map(inode);
+	if (IS_ERR(map)) {
+		ret = PTR_ERR(map);
+		goto unlock;
 	}
 
-out:
-	if (combined_buf) {
-		kfree(combined_buf);
+	if (!OUICHEFS_HAS_EXTENTS(sbi)) {
+		ret = ouichefs_flat_update(inode, map,
+					   iblock - OUICHEFS_NR_DIRECT_BLOCKS,
+					   end - iblock, punch);
+		goto unlock;
 	}
-	if (kv) {
-		kfree(kv);
+
+	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto unlock;
 	}
+	ret = ouichefs_extent_update(sbi, (struct ouichefs_extent_map *)map,
+				     iblock, end - iblock, punch);
+	if (!ret)
+		ouichefs_sync_block_map(inode, map, bh_index);
+	brelse(bh_index);
+
+unlock:
+	mutex_unlock(&ci->block_map_lock);
+
 	return ret;
 }
 
-static ssize_t custom_write_iter(struct kiocb *iocb, struct iov_iter *from)
+/*
+ * Free the index blocks of a big file that only map blocks from the first-th
+ * one on, which the caller already freed. The index block itself goes when
+ * the direct block pointers of the inode are enough.
+ */
+static int ouichefs_trim_index(struct inode *inode, uint32_t first)
 {
-	struct file *file = iocb->ki_filp;
-	struct inode *inode = file_inode(file);
 	struct super_block *sb = inode->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	loff_t pos = iocb->ki_pos;
-	size_t count = iov_iter_count(from);
-	loff_t old_size = inode->i_size;
-	loff_t new_size = max((loff_t)(pos + count), old_size);
-
-	pr_info("NEW WRITE CALL! pos: %lld, flags: %d, count: %lu, inode num slices: %d",
-		pos, iocb->ki_flags, count, ci->num_slices);
+	struct buffer_head *bh_index;
+	uint32_t *map, *level, leaf;
+	bool dirty = false;
+	int ret = 0;
+
+	mutex_lock(&ci->block_map_lock);
+	if (!ci->index_block)
+		goto unlock;
+
+	map = ouichefs_get_block_map(inode);
+	if (IS_ERR(map)) {
+		ret = PTR_ERR(map);
+		goto unlock;
+	}
 
-	if (is_new(ci->index_block)) {
-		/* Writing to a file that has never been written to */
-		if (will_be_small(new_size)) {
-			return write_small_file(inode, ci, sb, sbi, iocb, from);
-		} else {
-			return write_big_file(inode, ci, sb, sbi, iocb, from);
-		}
-	} else {
-		/* Writing to a file has previously been written to */
-		if (!is_small_file(&ci->vfs_inode)) {
-			return write_big_file(inode, ci, sb, sbi, iocb, from);
-		} else if (will_be_small(new_size)) {
-			return write_small_file(inode, ci, sb, sbi, iocb, from);
-		} else if (!will_be_small(new_size) &&
-			   is_small_file(&ci->vfs_inode)) {
-			return convert_small_to_big(iocb, from);
-		}
+	if (first <= OUICHEFS_NR_DIRECT_BLOCKS) {
+		if (!OUICHEFS_HAS_EXTENTS(OUICHEFS_SB(sb)))
+			ouichefs_flat_free(inode, map);
+		ouichefs_free_index_block(sb, ci->index_block);
+		kfree(ci->block_map);
+		ci->block_map = NULL;
+		ci->index_block = 0;
+		mark_inode_dirty(inode);
+		goto unlock;
 	}
-	return -EINVAL;
-}
 
-static ssize_t write_big_file(struct inode *inode,
-			      struct ouichefs_inode_info *ci,
-			      struct super_block *sb,
-			      struct ouichefs_sb_info *sbi, struct kiocb *iocb,
-			      struct iov_iter *from)
-{
-	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index = NULL, *bh_data = NULL;
-	size_t count = iov_iter_count(from);
-	loff_t pos = iocb->ki_pos;
-	if (iocb->ki_flags & IOCB_APPEND) {
-		pos = inode->i_size;
+	/* Emptied extents are already gone from the extent block */
+	if (OUICHEFS_HAS_EXTENTS(OUICHEFS_SB(sb)))
+		goto unlock;
+
+	first -= OUICHEFS_NR_DIRECT_BLOCKS;
+	if (first <= OUICHEFS_INDEX_DIRECT && map[OUICHEFS_INDEX_IND]) {
+		ouichefs_free_index_block(sb, map[OUICHEFS_INDEX_IND]);
+		map[OUICHEFS_INDEX_IND] = 0;
+		kfree(ci->ind_map);
+		ci->ind_map = NULL;
+		dirty = true;
 	}
 
-	ssize_t ret = 0;
-	ssize_t copied = 0;
-	uint32_t nr_allocs = 0;
-	loff_t old_size = inode->i_size;
-	loff_t new_size = max((loff_t)(pos + count), old_size);
-	uint32_t old_blocks;
+	if (!map[OUICHEFS_INDEX_DIND])
+		goto sync;
 
-	/* Check if this inode's index_block field has NOT yet been set */
-	if (ci->index_block == 0) {
-		/* This is a large file without an index block. We need to allocate an index block */
-		__le32 bno = get_free_block(sbi);
-		if (!bno) {
-			pr_err("Failed to allocate index block\n");
-			// put_inode(sbi, ci->vfs_inode.i_ino);
-			ret = -ENOSPC;
-			goto out;
-		}
-		ci->index_block = bno;
+	level = ouichefs_get_indirect(inode, map, OUICHEFS_INDEX_DIND,
+				      &ci->dind_map, false);
+	if (IS_ERR(level)) {
+		ret = PTR_ERR(level);
+		goto sync;
 	}
 
-	/* Calculate new file size and required blocks */
-	new_size = max((loff_t)(pos + count), old_size);
-	pr_info("old_size=%lld, new_size=%lld, index_block: %u\n", old_size,
-		new_size, ci->index_block);
-
-	/* Calculate required blocks for file (size > 128 bytes) */
-	nr_allocs = DIV_ROUND_UP(new_size, OUICHEFS_BLOCK_SIZE);
-
-	/* Check if we have enough free blocks */
-	if (nr_allocs > inode->i_blocks - 1) {
-		/* We need more blocks */
-		uint32_t blocks_needed = nr_allocs - (inode->i_blocks - 1);
-		if (blocks_needed > sbi->nr_free_blocks) {
-			pr_err("Not enough free blocks: %u needed, %u available\n",
-			       blocks_needed, sbi->nr_free_blocks);
-			return -ENOSPC;
+	if (first <= OUICHEFS_INDEX_DIRECT + OUICHEFS_INDEX_ENTRIES) {
+		for (leaf = 0; leaf < OUICHEFS_INDEX_ENTRIES; leaf++) {
+			if (level[leaf])
+				ouichefs_free_index_block(sb, level[leaf]);
 		}
+		ouichefs_free_index_block(sb, map[OUICHEFS_INDEX_DIND]);
+		map[OUICHEFS_INDEX_DIND] = 0;
+		kfree(ci->dind_map);
+		ci->dind_map = NULL;
+		dirty = true;
+		goto sync;
 	}
 
-	/* Read index block from disk */
-	if (ci->index_block == 0) {
-		pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
-		dump_stack();
-	}
-	bh_index = sb_bread(sb, ci->index_block);
+	/* Only the leaves past the new end of file go */
+	bh_index = sb_bread(sb, map[OUICHEFS_INDEX_DIND]);
 	if (!bh_index) {
 		ret = -EIO;
-		pr_err("Failed to read index block %u\n", ci->index_block);
-		goto out;
+		goto sync;
 	}
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
-
-	old_blocks = inode->i_blocks;
-
-	while (count > 0) {
-		/* Calculate which block and offset within block */
-		sector_t block_idx = pos / OUICHEFS_BLOCK_SIZE;
-		size_t block_offset = pos % OUICHEFS_BLOCK_SIZE;
-		size_t to_write =
-			min(count, OUICHEFS_BLOCK_SIZE - block_offset);
-		uint32_t physical_block;
+	leaf = DIV_ROUND_UP(first - OUICHEFS_INDEX_DIRECT -
+				    OUICHEFS_INDEX_ENTRIES,
+			    OUICHEFS_INDEX_ENTRIES);
+	for (; leaf < OUICHEFS_INDEX_ENTRIES; leaf++) {
+		if (!level[leaf])
+			continue;
+		ouichefs_free_index_block(sb, level[leaf]);
+		level[leaf] = 0;
+		((__le32 *)bh_index->b_data)[leaf] = 0;
+		mark_buffer_dirty_inode(bh_index, inode);
+	}
+	brelse(bh_index);
 
-		/* Check if block index is valid */
-		if (block_idx >= OUICHEFS_BLOCK_SIZE >> 2) {
-			ret = -EFBIG;
-			pr_err("Block index %llu exceeds maximum (%d)\n",
-			       block_idx, OUICHEFS_BLOCK_SIZE >> 2);
-			goto out;
+sync:
+	if (dirty) {
+		bh_index = sb_bread(sb, ci->index_block);
+		if (bh_index) {
+			ouichefs_sync_block_map(inode, map, bh_index);
+			brelse(bh_index);
+		} else if (!ret) {
+			ret = -EIO;
 		}
+	}
+unlock:
+	mutex_unlock(&ci->block_map_lock);
+
+	return ret;
+}
+
+/*
+ * Drop the reservations of the delayed blocks between first and last (file
+ * block numbers, inclusive), and of the index blocks no longer needed to map
+ * the others. The caller holds ci->block_map_lock.
+ */
+static void __ouichefs_release_delalloc(struct inode *inode, uint32_t first,
+					uint32_t last)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	unsigned long index;
+	uint32_t nr = 0, meta;
+	void *entry;
+
+	xa_for_each_range(&ci->i_delalloc, index, entry, first, last) {
+		xa_erase(&ci->i_delalloc, index);
+		if (index >= OUICHEFS_NR_DIRECT_BLOCKS)
+			ci->i_delalloc_ind--;
+		nr++;
+	}
+
+	meta = ouichefs_meta_blocks(sbi, ci->i_delalloc_ind);
+	nr += ci->i_meta_reserved - meta;
+	ci->i_meta_reserved = meta;
+	if (nr)
+		unreserve_blocks(sbi, nr);
+}
+
+void ouichefs_release_delalloc(struct inode *inode, uint32_t first,
+			       uint32_t last)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	mutex_lock(&ci->block_map_lock);
+	__ouichefs_release_delalloc(inode, first, last);
+	mutex_unlock(&ci->block_map_lock);
+}
+
+/*
+ * Reserve space for nr blocks from iblock, which are holes written through
+ * the page cache, and for the index blocks that may be needed to map them.
+ * No block is chosen yet: ouichefs_writeback_map_blocks() allocates the whole
+ * reserved run when the pages are written back. Returns the number of blocks
+ * reserved, or a negative error code if none could be.
+ */
+static int ouichefs_reserve_blocks(struct inode *inode, uint32_t iblock,
+				   uint32_t nr)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t i, meta;
+	bool ind;
+	int ret = 0;
+
+	mutex_lock(&ci->block_map_lock);
+	for (i = 0; i < nr; i++) {
+		if (xa_load(&ci->i_delalloc, iblock + i))
+			continue;
+		ind = iblock + i >= OUICHEFS_NR_DIRECT_BLOCKS;
+		meta = ind ? ouichefs_meta_blocks(sbi, ci->i_delalloc_ind + 1) -
+				     ci->i_meta_reserved :
+			     0;
+		if (!reserve_blocks(sbi, 1 + meta)) {
+			ret = -ENOSPC;
+			break;
+		}
+		ret = xa_err(xa_store(&ci->i_delalloc, iblock + i,
+				      xa_mk_value(1), GFP_NOFS));
+		if (ret) {
+			unreserve_blocks(sbi, 1 + meta);
+			break;
+		}
+		if (ind) {
+			ci->i_delalloc_ind++;
+			ci->i_meta_reserved += meta;
+		}
+	}
+	mutex_unlock(&ci->block_map_lock);
+
+	return i ? i : ret;
+}
+
+/*
+ * Return the length of the run of at most len blocks from iblock that are
+ * all reserved, or all not reserved. *reserved tells which.
+ */
+static uint32_t ouichefs_delalloc_run(struct inode *inode, uint32_t iblock,
+				      uint32_t len, bool *reserved)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t i;
+
+	mutex_lock(&ci->block_map_lock);
+	*reserved = xa_load(&ci->i_delalloc, iblock) != NULL;
+	for (i = 1; i < len; i++) {
+		if ((xa_load(&ci->i_delalloc, iblock + i) != NULL) != *reserved)
+			break;
+	}
+	mutex_unlock(&ci->block_map_lock);
+
+	return i;
+}
+
+/*
+ * Free all the data blocks of a big file, its index block and indirect blocks.
+ * The file is left without any block, the caller updates its size.
+ */
+int ouichefs_free_data_blocks(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_free_run run = { 0 };
+	struct ouichefs_extent_map *emap;
+	uint32_t *map, i;
+	int ret = 0;
+
+	if (WARN_ON_ONCE(!inode->i_blocks))
+		return -EIO;
+
+	mutex_lock(&ci->block_map_lock);
+	__ouichefs_release_delalloc(inode, 0, U32_MAX);
+	for (i = 0; i < OUICHEFS_NR_DIRECT_BLOCKS; i++) {
+		ouichefs_free_run_add(sbi, &run, ci->i_direct[i]);
+		ci->i_direct[i] = 0;
+	}
+	ouichefs_free_run_flush(sbi, &run);
+
+	if (!ci->index_block)
+		goto dirty;
+
+	map = ouichefs_get_block_map(inode);
+	if (IS_ERR(map)) {
+		ret = PTR_ERR(map);
+		goto dirty;
+	}
+
+	if (OUICHEFS_HAS_EXTENTS(sbi)) {
+		emap = (struct ouichefs_extent_map *)map;
+		for (i = 0; i < emap->nr_extents; i++)
+			put_blocks(sbi, emap->extents[i].start,
+				   ouichefs_ext_len(&emap->extents[i]));
+	} else {
+		ouichefs_flat_free(inode, map);
+	}
+
+	ouichefs_free_index_block(sb, ci->index_block);
+	kfree(ci->block_map);
+	ci->block_map = NULL;
+	ci->index_block = 0;
+
+dirty:
+	mark_inode_dirty(inode);
+	mutex_unlock(&ci->block_map_lock);
+
+	return ret;
+}
+
+/*
+ * Describe to iomap the mapping of the file at pos, as the largest run of
+ * physically contiguous blocks (or of holes) we can find in the index block.
+ * Holes written by direct I/O are allocated here and flagged as new so that
+ * iomap zeroes the parts of the blocks that are not written. Holes written
+ * through the page cache are only reserved (delayed allocation), their blocks
+ * are chosen at writeback time. Unwritten blocks are zeroed by iomap on read,
+ * and marked written once data reaches them (see ouichefs_prepare_ioend() and
+ * ouichefs_dio_write_end_io()). Reports (SEEK_HOLE/SEEK_DATA) and zeroing
+ * tell reserved holes apart, their data is in the page cache.
+ */
+static int ouichefs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+				unsigned int flags, struct iomap *iomap,
+				struct iomap *srcmap)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	uint32_t iblock = pos >> blkbits;
+	uint32_t last = (pos + length - 1) >> blkbits;
+	bool delalloc = (flags & IOMAP_WRITE) &&
+			!(flags & (IOMAP_DIRECT | IOMAP_ZERO));
+	bool create = (flags & IOMAP_WRITE) && (flags & IOMAP_DIRECT);
+	bool new = false, reserved = false;
+	uint32_t bno;
+	int ret;
+
+	/* Zeroing a hole is a no-op, it is neither allocated nor reserved */
+	ret = ouichefs_map_blocks(inode, iblock, last - iblock + 1, &bno,
+				  create ? OUICHEFS_MAP_CREATE : 0, &new);
+	if (ret < 0)
+		return ret;
+
+	if (!bno && delalloc) {
+		ret = ouichefs_reserve_blocks(inode, iblock, ret);
+		if (ret < 0)
+			return ret;
+	} else if (!bno && (flags & (IOMAP_REPORT | IOMAP_ZERO))) {
+		ret = ouichefs_delalloc_run(inode, iblock, ret, &reserved);
+	}
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t)iblock << blkbits;
+	iomap->length = (loff_t)ret << blkbits;
+	iomap->flags = new ? IOMAP_F_NEW : 0;
+	if (bno & OUICHEFS_UNWRITTEN) {
+		iomap->type = IOMAP_UNWRITTEN;
+		iomap->addr = (u64)(bno & ~OUICHEFS_UNWRITTEN) << blkbits;
+	} else if (bno) {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)bno << blkbits;
+	} else if (delalloc || reserved) {
+		iomap->type = IOMAP_DELALLOC;
+		iomap->addr = IOMAP_NULL_ADDR;
+	} else {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+	}
+
+	return 0;
+}
+
+/*
+ * Called once iomap is done with a mapping. After a write that grew the file
+ * (iomap already updated i_size), update the block count of the inode.
+ */
+static int ouichefs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+			      ssize_t written, unsigned int flags,
+			      struct iomap *iomap)
+{
+	if ((flags & IOMAP_WRITE) && (iomap->flags & IOMAP_F_SIZE_CHANGED)) {
+		inode->i_blocks =
+			DIV_ROUND_UP(inode->i_size, OUICHEFS_BLOCK_SIZE) + 1;
+		mark_inode_dirty(inode);
+	}
+
+	return 0;
+}
+
+static const struct iomap_ops ouichefs_iomap_ops = {
+	.iomap_begin = ouichefs_iomap_begin,
+	.iomap_end = ouichefs_iomap_end,
+};
+
+/*
+ * Fill folio with the content of the slice of a small file, like inline data:
+ * only the first i_size bytes come from the sliced block (or from the inode
+ * for an inline file), the rest of the folio is zeroed.
+ */
+static int ouichefs_read_small_folio(struct inode *inode, struct folio *folio)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	loff_t size = i_size_read(inode);
+	/* compact_file() may move the slice, read where it is only once */
+	uint32_t index_block = READ_ONCE(ci->index_block);
+	struct buffer_head *bh_data;
+	size_t len = 0;
+	void *kaddr;
+
+	if (folio_pos(folio) == 0 && ouichefs_is_inline(inode)) {
+		len = size;
+		kaddr = kmap_local_folio(folio, 0);
+		memcpy(kaddr, ci->i_data, len);
+		kunmap_local(kaddr);
+	} else if (folio_pos(folio) == 0 && size > 0 && index_block) {
+		len = min_t(loff_t, size, OUICHEFS_BLOCK_SIZE);
+		bh_data = sb_bread(inode->i_sb, index_block >> 5);
+		if (!bh_data) {
+			folio_unlock(folio);
+			return -EIO;
+		}
+		kaddr = kmap_local_folio(folio, 0);
+		memcpy(kaddr, slice_data(bh_data, index_block & 0b11111), len);
+		kunmap_local(kaddr);
+		brelse(bh_data);
+	}
+
+	folio_zero_segment(folio, len, folio_size(folio));
+	folio_mark_uptodate(folio);
+	folio_unlock(folio);
+
+	return 0;
+}
+
+/*
+ * Called by the page cache to read a single folio from the physical disk when
+ * readahead did not bring it in (e.g. random reads or readahead disabled).
+ */
+static int ouichefs_read_folio(struct file *file, struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+
+	if (is_small_file(inode))
+		return ouichefs_read_small_folio(inode, folio);
+
+	return iomap_read_folio(folio, &ouichefs_iomap_ops);
+}
+
+/*
+ * Called by the page cache to read a page from the physical disk and map it in
+ * memory. Each contiguous run returned by ouichefs_iomap_begin() is read with
+ * a single bio, possibly into a large folio.
+ */
+static void ouichefs_readahead(struct readahead_control *rac)
+{
+	/* A small file fits in a single folio, read_folio() is enough */
+	if (is_small_file(rac->mapping->host))
+		return;
+
+	iomap_readahead(rac, &ouichefs_iomap_ops);
+}
+
+/*
+ * Called by writeback to find where the dirty folio at offset goes on disk.
+ * The mapping is reused as long as offset is covered by it.
+ */
+static int ouichefs_writeback_map_blocks(struct iomap_writepage_ctx *wpc,
+					 struct inode *inode, loff_t offset)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	uint32_t iblock = offset >> blkbits;
+	bool reserved, new = false;
+	uint32_t len, bno;
+	int ret;
+
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length)
+		return 0;
+
+	ret = ouichefs_iomap_begin(inode, offset,
+				   inode->i_sb->s_maxbytes - offset, 0,
+				   &wpc->iomap, NULL);
+	if (ret || wpc->iomap.type != IOMAP_HOLE)
+		return ret;
+
+	/*
+	 * Blocks reserved by buffered writes are allocated now, as one run for
+	 * the whole reserved range so that they end up contiguous on disk. The
+	 * holes that were never written stay holes.
+	 */
+	len = ouichefs_delalloc_run(inode, iblock,
+				    wpc->iomap.length >> blkbits, &reserved);
+	if (!reserved) {
+		wpc->iomap.length = (loff_t)len << blkbits;
+		return 0;
+	}
+
+	ret = ouichefs_map_blocks(inode, iblock, len, &bno,
+				  OUICHEFS_MAP_CREATE | OUICHEFS_MAP_DELALLOC,
+				  &new);
+	if (ret < 0)
+		return ret;
+	ouichefs_release_delalloc(inode, iblock, iblock + ret - 1);
+
+	wpc->iomap.type = IOMAP_MAPPED;
+	wpc->iomap.addr = (u64)bno << blkbits;
+	wpc->iomap.length = (loff_t)ret << blkbits;
+
+	return 0;
+}
+
+/*
+ * Called before the bios of an ioend are submitted. Unwritten blocks are
+ * marked written here rather than on I/O completion: ouichefs does not order
+ * data and metadata writes anyway, newly allocated blocks are no different.
+ */
+static int ouichefs_prepare_ioend(struct iomap_ioend *ioend, int status)
+{
+	struct inode *inode = ioend->io_inode;
+	unsigned int blkbits = inode->i_blkbits;
+	uint32_t first, last;
+
+	if (status || ioend->io_type != IOMAP_UNWRITTEN)
+		return status;
+
+	first = ioend->io_offset >> blkbits;
+	last = (ioend->io_offset + ioend->io_size - 1) >> blkbits;
+
+	return ouichefs_update_blocks(inode, first, last - first + 1, false);
+}
+
+static const struct iomap_writeback_ops ouichefs_writeback_ops = {
+	.map_blocks = ouichefs_writeback_map_blocks,
+	.prepare_ioend = ouichefs_prepare_ioend,
+};
+
+/*
+ * Copy a dirty folio of a small file (only dirtied through mmap, write() goes
+ * straight to the slice) back into its slice, or into the inode for an inline
+ * file. The file size cannot change through mmap, so the data always fits in
+ * the slices of the file.
+ */
+static int ouichefs_write_small_folio(struct folio *folio,
+				      struct writeback_control *wbc,
+				      void *data)
+{
+	struct inode *inode = folio->mapping->host;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	loff_t size = i_size_read(inode);
+	struct buffer_head *bh_data;
+	uint32_t index_block;
+	void *kaddr;
+	size_t len;
+
+	/* Nothing past the end of file, or file converted in the meantime */
+	if (folio_pos(folio) != 0 || size == 0 || !is_small_file(inode)) {
+		folio_unlock(folio);
+		return 0;
+	}
+
+	if (ouichefs_is_inline(inode)) {
+		folio_start_writeback(folio);
+		kaddr = kmap_local_folio(folio, 0);
+		memcpy(ci->i_data, kaddr, size);
+		kunmap_local(kaddr);
+		folio_unlock(folio);
+		folio_end_writeback(folio);
+		mark_inode_dirty(inode);
+		return 0;
+	}
+
+	len = min_t(loff_t, size, OUICHEFS_BLOCK_SIZE);
+	index_block = READ_ONCE(ci->index_block);
+	bh_data = sb_bread(inode->i_sb, index_block >> 5);
+	if (!bh_data) {
+		mapping_set_error(folio->mapping, -EIO);
+		folio_unlock(folio);
+		return -EIO;
+	}
+
+	folio_start_writeback(folio);
+	kaddr = kmap_local_folio(folio, 0);
+	memcpy(slice_data(bh_data, index_block & 0b11111), kaddr, len);
+	kunmap_local(kaddr);
+	folio_unlock(folio);
+
+	mark_buffer_dirty(bh_data);
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		sync_dirty_buffer(bh_data);
+	brelse(bh_data);
+	folio_end_writeback(folio);
+
+	return 0;
+}
+
+/*
+ * Called by the page cache to write dirty folios to the physical disk (when
+ * sync is called or when memory is needed). Contiguous blocks are merged into
+ * large bios.
+ */
+static int ouichefs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = {};
+
+	if (is_small_file(mapping->host))
+		return write_cache_pages(mapping, wbc,
+					 ouichefs_write_small_folio, NULL);
+
+	return iomap_writepages(mapping, wbc, &wpc, &ouichefs_writeback_ops);
+}
+
+static sector_t ouichefs_bmap(struct address_space *mapping, sector_t block)
+{
+	/* Slices are not block aligned */
+	if (is_small_file(mapping->host))
+		return 0;
+
+	return iomap_bmap(mapping, block, &ouichefs_iomap_ops);
+}
+
+/*
+ * Files do not use buffer heads, which lets the page cache use large folios
+ * for them (see mapping_set_large_folios() in ouichefs_iget()). Small files
+ * are cached like inline data, their single folio is filled from the slice.
+ * O_DIRECT is handled by iomap_dio_rw() in the read/write paths, direct_IO
+ * is only set so that open() accepts O_DIRECT.
+ */
+const struct address_space_operations ouichefs_aops = {
+	.read_folio = ouichefs_read_folio,
+	.readahead = ouichefs_readahead,
+	.writepages = ouichefs_writepages,
+	.dirty_folio = filemap_dirty_folio,
+	.release_folio = iomap_release_folio,
+	.invalidate_folio = iomap_invalidate_folio,
+	.migrate_folio = filemap_migrate_folio,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.error_remove_page = generic_error_remove_page,
+	.bmap = ouichefs_bmap,
+	.direct_IO = noop_direct_IO,
+};
+
+/*
+ * O_DIRECT requests must be aligned on the logical block size of the device.
+ * Unaligned ones silently fall back to buffered I/O. Small (sliced) files
+ * never use direct I/O, their callers clear IOCB_DIRECT themselves.
+ */
+static void ouichefs_check_direct_io(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	unsigned int mask = bdev_logical_block_size(inode->i_sb->s_bdev) - 1;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return;
+
+	if ((iocb->ki_pos | iov_iter_count(iter) | iov_iter_alignment(iter)) &
+	    mask) {
+		pr_debug("unaligned O_DIRECT request, falling back to buffered I/O\n");
+		iocb->ki_flags &= ~IOCB_DIRECT;
+	}
+}
+
+static ssize_t custom_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	loff_t pos = iocb->ki_pos;
+	size_t count = iov_iter_count(to);
+	ssize_t ret = 0;
+
+	pr_debug("NEW READ CALL! pos=%lld, count=%zu, inode->i_size=%lld\n",
+		(long long)pos, count, (long long)inode->i_size);
+
+	ouichefs_check_direct_io(iocb, to);
+
+	/* Small files are cached, read_folio() fills them from their slice */
+	if (is_small_file(inode))
+		iocb->ki_flags &= ~IOCB_DIRECT;
+
+	/*
+	 * Files are read through the page cache: the generic code takes care
+	 * of readahead, cached re-reads and holes (zero-filled by iomap when
+	 * ouichefs_iomap_begin() reports one). O_DIRECT reads of big files go
+	 * straight to the disk.
+	 */
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+
+	inode_lock_shared(inode);
+	ret = iomap_dio_rw(iocb, to, &ouichefs_iomap_ops, NULL, 0, NULL, 0);
+	inode_unlock_shared(inode);
+	file_accessed(file);
+
+	return ret;
+}
+
+static struct buffer_head *init_slice_block(struct super_block *sb,
+					    uint32_t block, uint32_t class)
+{
+	uint32_t physical_block = le32_to_cpu(block);
+	if (physical_block == 0) {
+		pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
+		dump_stack();
+	}
+	/* The whole block is initialized, no need to read it */
+	struct buffer_head *bh_data = sb_getblk(sb, physical_block);
+	if (!bh_data) {
+		return NULL;
+	}
+
+	lock_buffer(bh_data);
+	memset(bh_data->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	OUICHEFS_SLICED_BLOCK_SB_SET_BITMAP(bh_data,
+					    OUICHEFS_BITMAP_CLASS_ALL_FREE(class));
+	OUICHEFS_SLICED_BLOCK_SB_SET_CLASS(bh_data, class);
+	set_buffer_uptodate(bh_data);
+	unlock_buffer(bh_data);
+
+	return bh_data;
+}
+
+static ssize_t allocate_and_init_slice_block(struct super_block *sb,
+					     struct ouichefs_sb_info *sbi,
+					     struct buffer_head **bh_data,
+					     uint32_t class)
+{
+	uint32_t free_block = get_free_block(sbi);
+	if (!free_block || free_block > (1 << 27)) {
+		pr_err("Failed to allocate sliced block. free_block: %u\n",
+		       free_block);
+		if (free_block)
+			put_block(sbi, free_block);
+		return -ENOSPC;
+	}
+	*bh_data = init_slice_block(sb, free_block, class);
+
+	if (!*bh_data) {
+		pr_err("Failed to initialize sliced block\n");
+		put_block(sbi, free_block);
+		return -EIO;
+	}
+
+	if (ouichefs_slice_add(sbi, free_block, class)) {
+		pr_err("Failed to add sliced block to the index\n");
+		brelse(*bh_data);
+		*bh_data = NULL;
+		put_block(sbi, free_block);
+		return -ENOMEM;
+	}
+
+	sbi->nr_sliced_blocks++;
+
+	pr_debug("Allocated new sliced block: %u (class %u). num sliced blocks: %u\n",
+		free_block, class, sbi->nr_sliced_blocks);
+
+	return (ssize_t)free_block;
+}
+
+/*
+ * Claim nr_slices consecutive slices of class, next to those of the other
+ * small files of dir (if not NULL), in a new sliced block if no block has
+ * enough room. Returns the first slice, with its block in *bno and *bh, or
+ * returns an error.
+ */
+static int ouichefs_claim_slices(struct super_block *sb, struct inode *dir,
+				 uint32_t class, uint32_t nr_slices,
+				 uint32_t *bno, struct buffer_head **bh)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t slice_no, hint = 0;
+	ssize_t free_block;
+
+	*bh = NULL;
+	if (dir)
+		hint = READ_ONCE(OUICHEFS_INODE(dir)->i_slice_hint[class]);
+
+	slice_no = ouichefs_slice_alloc(sbi, class, nr_slices, hint, bno);
+	if (!slice_no) {
+		free_block = allocate_and_init_slice_block(sb, sbi, bh, class);
+		if (free_block <= 0) {
+			pr_debug("Failed to allocate new sliced block: %zd\n",
+				 free_block);
+			return free_block ? free_block : -ENOSPC;
+		}
+		slice_no = ouichefs_slice_alloc(sbi, class, nr_slices,
+						free_block, bno);
+		if (!slice_no) {
+			brelse(*bh);
+			*bh = NULL;
+			return -ENOSPC;
+		}
+	}
+
+	/* Another writer may have taken the slices of the new block */
+	if (*bh && (*bh)->b_blocknr != *bno) {
+		brelse(*bh);
+		*bh = NULL;
+	}
+	if (!*bh) {
+		*bh = sb_bread(sb, *bno);
+		if (!*bh) {
+			pr_err("Failed to read sliced block %u\n", *bno);
+			ouichefs_slice_free(sbi, *bno, slice_no, nr_slices);
+			return -EIO;
+		}
+	}
+
+	if (dir)
+		WRITE_ONCE(OUICHEFS_INODE(dir)->i_slice_hint[class], *bno);
+
+	return slice_no;
+}
+
+/*
+ * A small file without a slice is new (never written) unless it is inline.
+ * Big files may have no index block, only direct blocks.
+ */
+static bool is_new(struct inode *inode)
+{
+	return is_small_file(inode) &&
+	       OUICHEFS_INODE(inode)->index_block == 0 &&
+	       !ouichefs_is_inline(inode);
+}
+
+static bool will_be_small(loff_t new_size)
+{
+	return new_size <= OUICHEFS_SMALL_FILE_MAX_SIZE;
+}
+
+static ssize_t write_big_file(struct inode *inode,
+			      struct ouichefs_inode_info *ci,
+			      struct super_block *sb,
+			      struct ouichefs_sb_info *sbi, struct kiocb *iocb,
+			      struct iov_iter *from);
+
+static ssize_t write_small_file(struct inode *inode,
+				struct ouichefs_inode_info *ci,
+				struct super_block *sb,
+				struct ouichefs_sb_info *sbi,
+				struct kiocb *iocb, struct iov_iter *from);
+
+static int ouichefs_make_big(struct inode *inode);
+
+static ssize_t delete_slice(struct super_block *sb,
+			    struct ouichefs_sb_info *sbi, uint32_t bno,
+			    uint32_t slice_no, uint32_t num_slices)
+{
+	/* Check if this small file actually has any data written to it */
+	if (bno == 0)
+		return 0;
+
+	if (num_slices == 0) {
+		pr_err("num_slices is 0. BAD!\n");
+		return 0;
+	}
+	struct buffer_head *bh = NULL;
+
+	if (bno == 0) {
+		pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
+		dump_stack();
+	}
+	bh = sb_bread(sb, bno);
+	if (!bh) {
+		pr_err("cannot read slice block %u\n", bno);
+		return -EIO;
+	}
+
+	/* Zero out the slices for the small file */
+	memset(slice_data(bh, slice_no), 0, num_slices * slice_size(bh));
+
+	pr_info("Deleting slice %u from block %u, num_slices: %u\n", slice_no,
+		bno, num_slices);
+	sbi->nr_used_slices -= num_slices;
+	pr_info("sbi->nr_used_slices: %u\n", sbi->nr_used_slices);
+
+	/* Free the sliced block if this was its last file */
+	if (ouichefs_slice_free(sbi, bno, slice_no, num_slices)) {
+		pr_info("sliced block %u is completely free, freeing it\n",
+			bno);
+		sbi->nr_sliced_blocks--;
+		pr_info("sbi->nr_sliced_blocks: %u\n", sbi->nr_sliced_blocks);
+		/* The block may be reused for file data, drop the buffer */
+		bforget(bh);
+		put_block(sbi, bno);
+		return 0;
+	}
+
+	ouichefs_slice_write_header(sbi, bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+ssize_t delete_slice_and_clear_inode(struct ouichefs_inode_info *ci,
+				     struct super_block *sb,
+				     struct ouichefs_sb_info *sbi)
+{
+	ssize_t ret = 0;
+
+	pr_info("inode index_block: %u, bno %u and slice_no %u\n",
+		OUICHEFS_INODE(&ci->vfs_inode)->index_block,
+		OUICHEFS_SMALL_FILE_GET_BNO(ci),
+		OUICHEFS_SMALL_FILE_GET_SLICE(ci));
+	uint32_t bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
+	uint32_t slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
+	uint32_t num_slices = ci->num_slices;
+	ret = delete_slice(sb, sbi, bno, slice_no, num_slices);
+	if (ret < 0) {
+		pr_err("Failed to delete slice: %zd\n", ret);
+		return ret;
+	}
+
+	pr_info("Slice deleted successfully\n\n");
+
+	/* Reset index block, and the data of an inline file */
+	ci->index_block = 0;
+	ci->vfs_inode.i_size = 0;
+	memset(ci->i_data, 0, OUICHEFS_INLINE_DATA_SIZE);
+
+	mark_inode_dirty(&ci->vfs_inode);
+
+	return 0;
+}
+
+/*
+ * Write to a small file that does not fit in a slice anymore. Its data is
+ * moved to its first block by ouichefs_make_big(), then the write goes on as
+ * for any big file, straight from the caller's iterator.
+ */
+static ssize_t convert_small_to_big(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct super_block *sb = inode->i_sb;
+	ssize_t ret;
+
+	pr_debug("Converting small file to big file. count: %zu, pos: %lld, inode->i_size: %lld\n",
+		iov_iter_count(from), iocb->ki_pos, inode->i_size);
+
+	ret = ouichefs_make_big(inode);
+	if (ret)
+		return ret;
+
+	return write_big_file(inode, OUICHEFS_INODE(inode), sb, OUICHEFS_SB(sb),
+			      iocb, from);
+}
+
+static ssize_t custom_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	loff_t pos, old_size, new_size;
+	size_t count;
+	ssize_t ret;
+
+	inode_lock(inode);
+
+	/* Handles O_APPEND (ki_pos = i_size) and the maximum file size */
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto unlock;
+
+	ouichefs_check_direct_io(iocb, from);
+
+	pos = iocb->ki_pos;
+	count = iov_iter_count(from);
+	old_size = inode->i_size;
+	new_size = max((loff_t)(pos + count), old_size);
+
+	pr_debug("NEW WRITE CALL! pos: %lld, flags: %d, count: %lu, inode num slices: %d",
+		pos, iocb->ki_flags, count, ci->num_slices);
+
+	/*
+	 * Small files are written straight into their slice. Flush the data
+	 * written through mmap to the slice first, the cached folio is
+	 * dropped once the slice is up to date.
+	 */
+	if (is_small_file(inode)) {
+		ret = filemap_write_and_wait(inode->i_mapping);
+		if (ret)
+			goto unlock;
+	}
+
+	if (is_new(inode)) {
+		/* Writing to a file that has never been written to */
+		if (will_be_small(new_size))
+			ret = write_small_file(inode, ci, sb, sbi, iocb, from);
+		else
+			ret = write_big_file(inode, ci, sb, sbi, iocb, from);
+	} else {
+		/* Writing to a file has previously been written to */
+		if (!is_small_file(&ci->vfs_inode))
+			ret = write_big_file(inode, ci, sb, sbi, iocb, from);
+		else if (will_be_small(new_size))
+			ret = write_small_file(inode, ci, sb, sbi, iocb, from);
+		else
+			ret = convert_small_to_big(iocb, from);
+	}
+
+	if (is_small_file(inode))
+		invalidate_inode_pages2(inode->i_mapping);
+
+unlock:
+	inode_unlock(inode);
+
+	/* Only O_SYNC/O_DSYNC writers wait for the data to reach the disk */
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+
+	return ret;
+}
+
+/*
+ * Called when an O_DIRECT write completes. The unwritten blocks it went to
+ * now hold data. iomap does not update the file size for direct writes, do it
+ * here if the write went past the end of file.
+ */
+static int ouichefs_dio_write_end_io(struct kiocb *iocb, ssize_t size,
+				     int error, unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	unsigned int blkbits = inode->i_blkbits;
+	uint32_t first, last;
+
+	if (error)
+		return error;
+
+	if (size && (flags & IOMAP_DIO_UNWRITTEN)) {
+		first = iocb->ki_pos >> blkbits;
+		last = (iocb->ki_pos + size - 1) >> blkbits;
+		error = ouichefs_update_blocks(inode, first, last - first + 1,
+					       false);
+		if (error)
+			return error;
+	}
+
+	if (size && iocb->ki_pos + size > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos + size);
+		inode->i_blocks =
+			DIV_ROUND_UP(inode->i_size, OUICHEFS_BLOCK_SIZE) + 1;
+		mark_inode_dirty(inode);
+	}
+
+	return 0;
+}
+
+static const struct iomap_dio_ops ouichefs_dio_write_ops = {
+	.end_io = ouichefs_dio_write_end_io,
+};
+
+static ssize_t write_big_file(struct inode *inode,
+			      struct ouichefs_inode_info *ci,
+			      struct super_block *sb,
+			      struct ouichefs_sb_info *sbi, struct kiocb *iocb,
+			      struct iov_iter *from)
+{
+	ssize_t ret, written = 0;
+
+	/*
+	 * From now on, this is a big file (see is_small_file()). Blocks, and
+	 * the index block once the direct blocks are used up, are allocated by
+	 * ouichefs_map_blocks().
+	 */
+	if (is_small_file(inode)) {
+		inode->i_blocks = 1;
+		mark_inode_dirty(inode);
+	}
+
+	ret = file_modified(iocb->ki_filp);
+	if (ret)
+		return ret;
+
+	/*
+	 * O_DIRECT writes go straight to the disk. If iomap could not
+	 * invalidate the page cache (-ENOTBLK) or did not write everything,
+	 * the rest goes through the page cache.
+	 */
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		ret = iomap_dio_rw(iocb, from, &ouichefs_iomap_ops,
+				   &ouichefs_dio_write_ops, 0, NULL, 0);
+		if (ret == -ENOTBLK)
+			ret = 0;
+		if (ret < 0 || !iov_iter_count(from))
+			return ret;
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		written = ret;
+	}
+
+	/*
+	 * Copy the data into the page cache. ouichefs_iomap_begin() reserves
+	 * the blocks and ouichefs_iomap_end() updates the inode. Dirty folios
+	 * are flushed by writeback, only fsync() and O_SYNC writers wait for
+	 * the disk. The caller holds the inode lock.
+	 */
+	ret = iomap_file_buffered_write(iocb, from, &ouichefs_iomap_ops);
+	if (ret < 0)
+		return written ? written : ret;
+
+	return written + ret;
+}
+
+/*
+ * Write to a small file that fits in its inode. The data is written to disk
+ * with the inode, by ouichefs_write_inode().
+ */
+static ssize_t write_inline_file(struct inode *inode,
+				 struct ouichefs_inode_info *ci,
+				 struct kiocb *iocb, struct iov_iter *from,
+				 loff_t pos)
+{
+	size_t count = iov_iter_count(from);
+	loff_t old_size = inode->i_size;
+
+	/* Zero-fill any gap between old data and write position */
+	if (pos > old_size)
+		memset(ci->i_data + old_size, 0, pos - old_size);
+
+	if (copy_from_iter(ci->i_data + pos, count, from) != count)
+		return -EFAULT;
+
+	inode->i_size = max_t(loff_t, pos + count, old_size);
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	iocb->ki_pos = pos + count;
+
+	return count;
+}
+
+static ssize_t write_small_file(struct inode *inode,
+				struct ouichefs_inode_info *ci,
+				struct super_block *sb,
+				struct ouichefs_sb_info *sbi,
+				struct kiocb *iocb, struct iov_iter *from)
+{
+	struct buffer_head *bh_data = NULL, *bh_new, *bh_old = NULL;
+	bool inline_data = ouichefs_is_inline(inode);
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	if (iocb->ki_flags & IOCB_APPEND) {
+		pos = inode->i_size;
+		pr_info("IOCB_APPEND flag set, pos set to inode->i_size: %lld\n",
+			inode->i_size);
+	}	
+	ssize_t ret = 0;
+	uint32_t block_to_write = 0;
+	uint32_t slice_to_write = 0;
+	loff_t old_size = inode->i_size;
+	loff_t new_size = max((loff_t)(pos + count), old_size);
+
+	uint32_t old_num_slices, new_num_slices;
+	uint32_t used_slices; /* Slices claimed by this write */
+	uint32_t moved_bno = 0, moved_slice = 0; /* Old slices of a moved file */
+	uint32_t class = slice_class(new_size);
+	struct inode *dir = NULL;
+
+	/* Files without a slice stay in their inode as long as they fit */
+	if (ci->index_block == 0 && new_size <= OUICHEFS_INLINE_DATA_SIZE)
+		return write_inline_file(inode, ci, iocb, from, pos);
+
+	/* Check if this inode's index_block field has NOT yet been set */
+	if (ci->index_block == 0) {
+		/*
+		 * This is a small file that has not yet been added to a
+		 * partially filled block. Claim its slices in the mirrored
+		 * sliced block headers, in a new sliced block if no block of
+		 * its class has enough consecutive free slices.
+		 */
+		uint32_t nr_slices =
+			DIV_ROUND_UP(new_size, OUICHEFS_SLICE_CLASS_SIZE(class));
+		int slice_no;
+
+		dir = slice_hint_dir(inode);
+		slice_no = ouichefs_claim_slices(sb, dir, class, nr_slices,
+						 &block_to_write, &bh_data);
+		if (slice_no < 0) {
+			ret = slice_no;
+			goto out;
+		}
+		slice_to_write = slice_no;
+
+		ci->num_slices = nr_slices;
+		mark_inode_dirty(inode);
+		used_slices = ci->num_slices;
+	} else {
+		pr_info("This is a small file that has already been added to a sliced block.\n");
+		uint32_t old_bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
+		uint32_t old_slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
+
+		if (ci->num_slices == 0) {
+			pr_err("num_slices is 0, this should never be the case here!\n");
+			ret = -EIO;
+			goto out;
+		}
+		old_num_slices = ci->num_slices;
+
+		pr_info("old_bno: %u, old_slice_no: %u\n", old_bno,
+			old_slice_no);
+
+		if (old_bno == 0 || old_slice_no == 0) {
+			pr_err("bno or slice_no is 0, this should not happen!\n");
+			ret = -EIO;
+			goto out;
+		}
+
+		if (old_bno == 0) {
+			pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
+			dump_stack();
+		}
+		bh_data = sb_bread(sb, old_bno);
+		if (!bh_data) {
+			pr_err("Failed to read sliced block %u\n",
+			       block_to_write);
+			ret = -EIO;
+			goto out;
+		}
+		new_num_slices = DIV_ROUND_UP(new_size, slice_size(bh_data));
+
+		if (old_num_slices == new_num_slices) {
+			pr_info("unchanged amount of slices, just writing the file");
+			block_to_write = old_bno;
+			slice_to_write = old_slice_no;
+			used_slices = 0;
+		} else if (new_num_slices > old_num_slices &&
+			   class == OUICHEFS_SLICED_BLOCK_SB_CLASS(bh_data) &&
+			   ouichefs_slice_grow(sbi, old_bno, old_slice_no,
+					       old_num_slices,
+					       new_num_slices)) {
+			/* The next slices are free, no need to move the file */
+			pr_debug("growing from %u to %u slices in place\n",
+				old_num_slices, new_num_slices);
+			block_to_write = old_bno;
+			slice_to_write = old_slice_no;
+			used_slices = new_num_slices - old_num_slices;
+			ci->num_slices = new_num_slices;
+		} else {
+			/*
+			 * Move the file to new slices, in the block of its new
+			 * class. The old data is copied there first, then the
+			 * write goes to the new slices like any other.
+			 */
+			int slice_no;
+
+			new_num_slices = DIV_ROUND_UP(
+				new_size, OUICHEFS_SLICE_CLASS_SIZE(class));
+			dir = slice_hint_dir(inode);
+			slice_no = ouichefs_claim_slices(sb, dir, class,
+							 new_num_slices,
+							 &block_to_write,
+							 &bh_new);
+			if (slice_no < 0) {
+				ret = slice_no;
+				goto out;
+			}
+			slice_to_write = slice_no;
+			memcpy(slice_data(bh_new, slice_to_write),
+			       slice_data(bh_data, old_slice_no), old_size);
+			bh_old = bh_data;
+			bh_data = bh_new;
+			moved_bno = old_bno;
+			moved_slice = old_slice_no;
+			used_slices = new_num_slices;
+		}
+	}
+
+	if (!bh_data) {
+		/* We should have found a slice by now. If bh_data is null it means we have not. */
+		pr_err("bh_data is NULL, this should not happen!\n");
+		ret = -EIO;
+		goto out;
+	}
+
+	pr_info("block_to_write: %d, slice to write: %d, pos: %llu\n",
+		block_to_write, slice_to_write, pos);
+
+	/* An inline file outgrowing its inode moves to the new slice */
+	if (inline_data) {
+		memcpy(slice_data(bh_data, slice_to_write), ci->i_data,
+		       old_size);
+	}
+
+	/* Copy data from user space */
+	if (copy_from_iter(slice_data(bh_data, slice_to_write) + pos, count,
+			   from) != count) {
+		ret = -EFAULT;
+		if (bh_old) {
+			/* The file stays in its old slices */
+			memset(slice_data(bh_data, slice_to_write), 0,
+			       used_slices * slice_size(bh_data));
+			if (ouichefs_slice_free(sbi, block_to_write,
+						slice_to_write, used_slices)) {
+				sbi->nr_sliced_blocks--;
+				bforget(bh_data);
+				put_block(sbi, block_to_write);
+			} else {
+				ouichefs_slice_write_header(sbi, bh_data);
+				mark_buffer_dirty(bh_data);
+				brelse(bh_data);
+			}
+			bh_data = NULL;
+		}
+		goto out;
+	}
+	if (inline_data)
+		memset(ci->i_data, 0, OUICHEFS_INLINE_DATA_SIZE);
+
+	pr_info("BEFORE sbi->nr_used_slices: %u\n", sbi->nr_used_slices);
+	sbi->nr_used_slices += used_slices;
+	pr_info("AFTER sbi->nr_used_slices: %u\n", sbi->nr_used_slices);
+
+	/* Mark buffer dirty and sync */
+	ouichefs_slice_write_header(sbi, bh_data);
+	mark_buffer_dirty(bh_data);
+	sync_dirty_buffer(bh_data);
+	brelse(bh_data);
+	bh_data = NULL;
+	ret = count;
+
+	/* Update inode metadata */
+	inode->i_size = new_size;
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+
+	ci->index_block = (block_to_write << 5) + slice_to_write;
+	pr_info("ci->index_block: %u\n\n", ci->index_block);
+	mark_inode_dirty(inode);
+
+	/* The data of a moved file is safe in its new slices */
+	if (bh_old) {
+		brelse(bh_old);
+		bh_old = NULL;
+		delete_slice(sb, sbi, moved_bno, moved_slice, old_num_slices);
+		ci->num_slices = used_slices;
+	}
+
+	/* Update file position */
+	iocb->ki_pos = pos + count;
+
+	goto out;
+out:
+	// pr_info("returning : %lx\n", ret);
+	if (bh_data)
+		brelse(bh_data);
+	brelse(bh_old);
+	iput(dir);
+
+	return ret;
+}
+
+/*
+ * Copy the size bytes of data to new slices, next to those of the other
+ * small files of dir (if not NULL). The file they belong to is left alone.
+ * Returns the first slice and sets *bno, or returns an error.
+ */
+static int ouichefs_new_slices(struct super_block *sb, struct inode *dir,
+			       const void *data, size_t size, uint32_t *bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t class = slice_class(size);
+	uint32_t nr_slices =
+		DIV_ROUND_UP(size, OUICHEFS_SLICE_CLASS_SIZE(class));
+	struct buffer_head *bh;
+	int slice_no;
+
+	slice_no = ouichefs_claim_slices(sb, dir, class, nr_slices, bno, &bh);
+	if (slice_no < 0)
+		return slice_no;
+
+	memcpy(slice_data(bh, slice_no), data, size);
+	ouichefs_slice_write_header(sbi, bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	sbi->nr_used_slices += nr_slices;
+
+	return slice_no;
+}
+
+/*
+ * Give the new, empty regular file inode its first size bytes, taken from
+ * data, placing its slices next to those of the other files of dir. Nothing
+ * is synced: batched creations flush everything once they are done.
+ */
+int ouichefs_fill_small_file(struct inode *inode, struct inode *dir,
+			     const void *data, size_t size)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t class = slice_class(size);
+	uint32_t bno;
+	int slice_no;
+
+	if (!will_be_small(size))
+		return -EFBIG;
+
+	if (size <= OUICHEFS_INLINE_DATA_SIZE) {
+		memcpy(ci->i_data, data, size);
+		goto out;
+	}
+
+	slice_no = ouichefs_new_slices(inode->i_sb, dir, data, size, &bno);
+	if (slice_no < 0)
+		return slice_no;
+
+	ci->index_block = (bno << 5) + slice_no;
+	ci->num_slices = DIV_ROUND_UP(size, OUICHEFS_SLICE_CLASS_SIZE(class));
+out:
+	inode->i_size = size;
+	return 0;
+}
+
+/*
+ * Copy the content of the small file inode to buf, which holds at least a
+ * block. *bh caches the last sliced block read so that files sharing a block
+ * only read it once; the caller releases it.
+ * Returns the size of the file, or -EFBIG if it is not a small file.
+ */
+ssize_t ouichefs_read_small_file(struct inode *inode, struct buffer_head **bh,
+				 void *buf)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t bno;
+	ssize_t ret;
+
+	inode_lock_shared(inode);
+
+	/* Data written through mmap goes to the slice first */
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		goto unlock;
+
+	ret = i_size_read(inode);
+	if (!is_small_file(inode) || !will_be_small(ret)) {
+		ret = -EFBIG;
+		goto unlock;
+	}
+	if (ouichefs_is_inline(inode)) {
+		memcpy(buf, ci->i_data, ret);
+		goto unlock;
+	}
+	if (!ret || !ci->index_block)
+		goto unlock;
+
+	bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
+	if (!*bh || (*bh)->b_blocknr != bno) {
+		brelse(*bh);
+		*bh = sb_bread(inode->i_sb, bno);
+		if (!*bh) {
+			ret = -EIO;
+			goto unlock;
+		}
+	}
+	memcpy(buf, slice_data(*bh, OUICHEFS_SMALL_FILE_GET_SLICE(ci)), ret);
+unlock:
+	inode_unlock_shared(inode);
+	return ret;
+}
+
+/*
+ * Called before a read-only mapped folio becomes writable. Big files reserve
+ * the blocks under the folio here, writeback allocates them.
+ * Small files are written back into their slice, which already exists.
+ */
+static vm_fault_t ouichefs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	if (is_small_file(inode))
+		return filemap_page_mkwrite(vmf);
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	ret = iomap_page_mkwrite(vmf, &ouichefs_iomap_ops);
+	sb_end_pagefault(inode->i_sb);
+
+	return ret;
+}
+
+/*
+ * Turn a small file into a big one. Its data, if any, moves from the slice (or
+ * the inode) to its first block: a small file always fits in a block.
+ */
+static int ouichefs_make_big(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t slice_bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
+	uint32_t slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
+	struct buffer_head *bh_slice = NULL, *bh_data;
+	bool inline_data;
+	char *src;
+	uint32_t bno = 0;
+	int ret;
 
-		/* Get or allocate physical block */
-		physical_block = le32_to_cpu(index->blocks[block_idx]);
-		if (physical_block == 0) {
-			/* Allocate new block */
-			physical_block = get_free_block(sbi);
+	/* Data written through mmap goes to the slice first */
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		return ret;
 
-			if (!physical_block) {
-				ret = -ENOSPC;
-				pr_err("Failed to allocate physical block\n");
-				goto out;
-			}
-			index->blocks[block_idx] = cpu_to_le32(physical_block);
-			mark_buffer_dirty(bh_index);
+	inline_data = ouichefs_is_inline(inode);
+	if (!is_new(inode) && inode->i_size) {
+		if (inline_data) {
+			src = ci->i_data;
+		} else {
+			bh_slice = sb_bread(sb, slice_bno);
+			if (!bh_slice)
+				return -EIO;
+			src = slice_data(bh_slice, slice_no);
 		}
 
-		/* Read the block (we might be doing partial write) */
-		if (physical_block == 0) {
-			pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
-			dump_stack();
+		bno = get_free_block(sbi);
+		if (!bno) {
+			brelse(bh_slice);
+			return -ENOSPC;
 		}
-		bh_data = sb_bread(sb, physical_block);
+		bh_data = sb_getblk(sb, bno);
 		if (!bh_data) {
-			ret = -EIO;
-			pr_err("Failed to read data block %u\n",
-			       physical_block);
-			goto out;
+			put_block(sbi, bno);
+			brelse(bh_slice);
+			return -EIO;
 		}
-		/* If writing beyond current file size, zero the gap */
-		if (pos > inode->i_size) {
-			loff_t gap_start = inode->i_size;
-			loff_t gap_end = pos;
-
-			/* Zero the gap in this block if needed */
-			if (gap_start / OUICHEFS_BLOCK_SIZE == block_idx) {
-				size_t gap_offset =
-					gap_start % OUICHEFS_BLOCK_SIZE;
-				size_t gap_size =
-					min(gap_end - gap_start,
-					    (loff_t)(OUICHEFS_BLOCK_SIZE -
-						     gap_offset));
-				memset(bh_data->b_data + gap_offset, 0,
-				       gap_size);
-			}
+
+		lock_buffer(bh_data);
+		memcpy(bh_data->b_data, src, inode->i_size);
+		memset(bh_data->b_data + inode->i_size, 0,
+		       OUICHEFS_BLOCK_SIZE - inode->i_size);
+		set_buffer_uptodate(bh_data);
+		unlock_buffer(bh_data);
+		/*
+		 * From now on the block is read and written through the page
+		 * cache of the file, do not leave a dirty copy behind.
+		 */
+		mark_buffer_dirty(bh_data);
+		ret = sync_dirty_buffer(bh_data);
+		brelse(bh_data);
+		brelse(bh_slice);
+		if (ret) {
+			put_block(sbi, bno);
+			return ret;
 		}
+	}
 
-		/* Copy data from user space */
-		if (copy_from_iter(bh_data->b_data + block_offset, to_write,
-				   from) != to_write) {
-			brelse(bh_data);
-			pr_err("Failed to copy data from iter\n");
-			ret = -EFAULT;
-			goto out;
+	if (inline_data) {
+		memset(ci->i_data, 0, OUICHEFS_INLINE_DATA_SIZE);
+	} else if (!is_new(inode)) {
+		ret = delete_slice(sb, sbi, slice_bno, slice_no,
+				   ci->num_slices);
+		if (ret) {
+			if (bno)
+				put_block(sbi, bno);
+			return ret;
 		}
+		ci->index_block = 0;
+		ci->num_slices = 0;
+	}
 
-		/* Mark buffer dirty and sync */
-		mark_buffer_dirty(bh_data);
-		sync_dirty_buffer(bh_data);
-		brelse(bh_data);
-		bh_data = NULL;
+	ci->i_direct[0] = bno;
+	inode->i_blocks = DIV_ROUND_UP(inode->i_size, OUICHEFS_BLOCK_SIZE) + 1;
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+/*
+ * Resize a small file that stays small. Shrinking frees the slices past the
+ * new end of file (an inline file stays in its inode), growing writes zeroes
+ * like any other small write.
+ */
+static int ouichefs_truncate_small(struct inode *inode, loff_t newsize)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t slice_bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
+	uint32_t slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
+	uint32_t nr_slices;
+	struct buffer_head *bh_slice;
+	struct kiocb kiocb;
+	struct iov_iter iter;
+	struct kvec kv;
+	ssize_t ret;
+
+	if (newsize > inode->i_size) {
+		memset(&kiocb, 0, sizeof(kiocb));
+		kiocb.ki_pos = inode->i_size;
+		kv.iov_base = page_address(ZERO_PAGE(0));
+		kv.iov_len = newsize - inode->i_size;
+		iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, kv.iov_len);
+
+		ret = write_small_file(inode, ci, sb, sbi, &kiocb, &iter);
+		invalidate_inode_pages2(inode->i_mapping);
+
+		return ret < 0 ? ret : 0;
+	}
 
-		/* Update counters */
-		pos += to_write;
-		count -= to_write;
-		copied += to_write;
+	if (!newsize) {
+		ret = delete_slice_and_clear_inode(ci, sb, sbi);
+		truncate_pagecache(inode, 0);
+		return ret;
 	}
-	/* Update inode metadata */
-	if (pos > inode->i_size) {
-		inode->i_size = pos;
+
+	if (ouichefs_is_inline(inode)) {
+		memset(ci->i_data + newsize, 0, inode->i_size - newsize);
+		truncate_setsize(inode, newsize);
+		mark_inode_dirty(inode);
+		return 0;
 	}
 
-	/* Update block count */
-	inode->i_blocks = DIV_ROUND_UP(inode->i_size, OUICHEFS_BLOCK_SIZE) + 1;
-	inode->i_mtime = inode->i_ctime = current_time(inode);
+	/* What is left of the last slice must read as zeroes if it grows */
+	bh_slice = sb_bread(sb, slice_bno);
+	if (!bh_slice)
+		return -EIO;
+	nr_slices = DIV_ROUND_UP(newsize, slice_size(bh_slice));
+	memset(slice_data(bh_slice, slice_no) + newsize, 0,
+	       nr_slices * slice_size(bh_slice) - newsize);
+	mark_buffer_dirty(bh_slice);
+	brelse(bh_slice);
+
+	if (nr_slices < ci->num_slices) {
+		ret = delete_slice(sb, sbi, slice_bno, slice_no + nr_slices,
+				   ci->num_slices - nr_slices);
+		if (ret)
+			return ret;
+		ci->num_slices = nr_slices;
+	}
+
+	truncate_setsize(inode, newsize);
 	mark_inode_dirty(inode);
 
-	/* Update file position */
-	iocb->ki_pos = pos;
-	ret = copied;
+	return 0;
+}
+
+/*
+ * Shrink a big file to a size that fits in a slice: the data that is kept is
+ * copied from the page cache to a new slice (or to the inode), and the blocks
+ * are only freed once it is there. On failure, the file is left as it was.
+ */
+static int ouichefs_truncate_big_to_small(struct inode *inode, loff_t newsize)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t class = slice_class(newsize);
+	uint32_t nr_slices = 0, bno = 0;
+	struct folio *folio;
+	struct inode *dir;
+	char *buf = NULL, *addr;
+	int slice_no = 0, ret;
+
+	if (newsize) {
+		buf = kmalloc(newsize, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+
+		folio = read_mapping_folio(inode->i_mapping, 0, NULL);
+		if (IS_ERR(folio)) {
+			kfree(buf);
+			return PTR_ERR(folio);
+		}
+		addr = kmap_local_folio(folio, 0);
+		memcpy(buf, addr, newsize);
+		kunmap_local(addr);
+		folio_put(folio);
+	}
+
+	if (newsize > OUICHEFS_INLINE_DATA_SIZE) {
+		dir = slice_hint_dir(inode);
+		slice_no = ouichefs_new_slices(sb, dir, buf, newsize, &bno);
+		iput(dir);
+		if (slice_no < 0) {
+			ret = slice_no;
+			goto out;
+		}
+		nr_slices = DIV_ROUND_UP(newsize,
+					 OUICHEFS_SLICE_CLASS_SIZE(class));
+	}
+
+	truncate_pagecache(inode, 0);
+	ret = ouichefs_free_data_blocks(inode);
+	if (ret) {
+		if (slice_no)
+			delete_slice(sb, OUICHEFS_SB(sb), bno, slice_no,
+				     nr_slices);
+		goto out;
+	}
 
-	/* Sync index block */
-	sync_dirty_buffer(bh_index);
+	/*
+	 * Without any block, the file is small again (see is_small_file()),
+	 * and new if it is empty (see is_new()).
+	 */
+	inode->i_blocks = 0;
+	if (slice_no) {
+		ci->index_block = (bno << 5) + slice_no;
+		ci->num_slices = nr_slices;
+	} else if (newsize) {
+		memcpy(ci->i_data, buf, newsize);
+	}
+	i_size_write(inode, newsize);
+	mark_inode_dirty(inode);
 
 out:
+	kfree(buf);
+	return ret;
+}
 
-	if (bh_index)
-		brelse(bh_index);
-	if (bh_data)
-		brelse(bh_data);
+/*
+ * Resize a big file. The blocks past the new end of file are freed in runs,
+ * along with the index blocks that do not map anything anymore.
+ */
+static int ouichefs_truncate_big(struct inode *inode, loff_t newsize)
+{
+	uint32_t nr_iblocks = inode->i_sb->s_maxbytes >> inode->i_blkbits;
+	loff_t oldsize = inode->i_size;
+	uint32_t first;
+	int ret;
+
+	if (newsize > oldsize) {
+		/* The old last block may hold stale data past the end of file */
+		ret = iomap_zero_range(inode, oldsize, newsize - oldsize, NULL,
+				       &ouichefs_iomap_ops);
+		if (ret)
+			return ret;
+		truncate_setsize(inode, newsize);
+		goto dirty;
+	}
+
+	ret = iomap_truncate_page(inode, newsize, NULL, &ouichefs_iomap_ops);
+	if (ret)
+		return ret;
+	truncate_setsize(inode, newsize);
+
+	first = DIV_ROUND_UP(newsize, OUICHEFS_BLOCK_SIZE);
+	ouichefs_release_delalloc(inode, first, U32_MAX);
+	ret = ouichefs_update_blocks(inode, first, nr_iblocks - first, true);
+	if (!ret)
+		ret = ouichefs_trim_index(inode, first);
+
+dirty:
+	inode->i_blocks = DIV_ROUND_UP(newsize, OUICHEFS_BLOCK_SIZE) + 1;
+	mark_inode_dirty(inode);
 
 	return ret;
 }
 
-static uint32_t get_consequitive_free_slices(struct buffer_head **bh_data,
-					     struct ouichefs_inode_info *ci,
-					     loff_t file_size)
+/*
+ * Change the size of a regular file, called by ouichefs_setattr() with the
+ * inode locked. A file stays small as long as it fits in a slice, a big file
+ * shrunk that much moves back to a slice.
+ */
+int ouichefs_truncate(struct inode *inode, loff_t newsize)
 {
-	/* Check how many consequtive slices we need and see if we have that many in the current block */
-	uint32_t slice_to_write = 0;
-	if (file_size > OUICHEFS_BLOCK_SIZE) {
-		pr_err("File size %lld exceeds maximum allowed size %d\n",
-		       file_size, OUICHEFS_BLOCK_SIZE);
-		return 0; // No valid slice to write
-	}
-
-	uint32_t bitmap = *(uint32_t *)(*bh_data)->b_data;
-	uint32_t num_slices_needed =
-		DIV_ROUND_UP(file_size, OUICHEFS_SLICE_SIZE);
-	uint32_t mask = ((1U << num_slices_needed) - 1) << 1;
-
-	for (int i = 1; i <= OUICHEFS_BITMAP_SIZE_BITS - (num_slices_needed);
-	     i++) {
-		if ((bitmap | mask) == bitmap) {
-			slice_to_write = i;
-			*(uint32_t *)(*bh_data)->b_data &= ~mask;
-			break;
-		}
-		mask <<= 1;
+	int ret;
+
+	if (is_small_file(inode)) {
+		/* Data written through mmap goes to the slice first */
+		ret = filemap_write_and_wait(inode->i_mapping);
+		if (ret)
+			return ret;
+
+		if (will_be_small(newsize))
+			return ouichefs_truncate_small(inode, newsize);
+
+		ret = ouichefs_make_big(inode);
+		if (ret)
+			return ret;
+	} else if (newsize < inode->i_size && will_be_small(newsize)) {
+		return ouichefs_truncate_big_to_small(inode, newsize);
 	}
 
-	if (slice_to_write != 0) {
-		ci->num_slices = (uint16_t)num_slices_needed;
-		mark_inode_dirty(&ci->vfs_inode);
-		}
-	return slice_to_write;
+	return ouichefs_truncate_big(inode, newsize);
 }
 
-static ssize_t write_small_file(struct inode *inode,
-				struct ouichefs_inode_info *ci,
-				struct super_block *sb,
-				struct ouichefs_sb_info *sbi,
-				struct kiocb *iocb, struct iov_iter *from)
+/*
+ * Zero the bytes of a small file from start to end (excluded) in its cached
+ * folio, which is then written back to the slice.
+ */
+static int ouichefs_zero_small_range(struct file *file, loff_t start,
+				     loff_t end)
 {
-	struct buffer_head *bh_index = NULL, *bh_data = NULL;
-	size_t count = iov_iter_count(from);
-	loff_t pos = iocb->ki_pos;
-	if (iocb->ki_flags & IOCB_APPEND) {
-		pos = inode->i_size;
-		pr_info("IOCB_APPEND flag set, pos set to inode->i_size: %lld\n",
-			inode->i_size);
-	}	
-	ssize_t ret = 0;
-	uint32_t block_to_write = 0;
-	uint32_t slice_to_write = 0;
-	loff_t old_size = inode->i_size;
-	loff_t new_size = max((loff_t)(pos + count), old_size);
+	struct inode *inode = file_inode(file);
+	struct folio *folio;
 
-	uint32_t old_num_slices = DIV_ROUND_UP(old_size, OUICHEFS_SLICE_SIZE);
-	uint32_t new_num_slices = DIV_ROUND_UP(new_size, OUICHEFS_SLICE_SIZE);
+	end = min(end, i_size_read(inode));
+	if (start >= end)
+		return 0;
 
-	/* Check if this inode's index_block field has NOT yet been set */
-	if (ci->index_block == 0) {
-		/* This is a small file that has not yet been added to a partially filled block.
-			Try to find a slice for it. */
-		if (sbi->s_free_sliced_blocks == 0) {
-			/* No sliced blocks available, allocate a new one and read it into bh_data */
-			block_to_write = allocate_and_init_slice_block(
-				sb, sbi, &bh_data);
-			if (block_to_write <= 0) { /* 0 is not a valid block*/
-				ret = block_to_write;
-				goto out;
-			}
-			sbi->s_free_sliced_blocks = (uint32_t)block_to_write;
+	folio = read_mapping_folio(inode->i_mapping, 0, file);
+	if (IS_ERR(folio))
+		return PTR_ERR(folio);
+	folio_lock(folio);
+	folio_zero_range(folio, start, end - start);
+	folio_mark_dirty(folio);
+	folio_unlock(folio);
+	folio_put(folio);
 
-		} else {
-			/* There already is a sliced block, read it. */
-			block_to_write = sbi->s_free_sliced_blocks;
-			if (block_to_write == 0) {
-				pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
-				dump_stack();
-			}
-			bh_data = sb_bread(sb, block_to_write);
-			if (!bh_data) {
-				pr_err("Failed to read sliced block\n");
-				ret = -EIO;
-				goto out;
-			}
-		}
+	return filemap_write_and_wait(inode->i_mapping);
+}
 
-		/* Check how many consequtive slices we need and see if we have that many in the current block */
-		slice_to_write =
-			get_consequitive_free_slices(&bh_data, ci, new_size);
+/*
+ * Preallocate the blocks of the file from first to last (excluded) that are
+ * holes, as unwritten blocks taken in contiguous runs from the bitmap. Holes
+ * already reserved by buffered writes get their blocks now.
+ */
+static int ouichefs_prealloc(struct inode *inode, uint32_t first,
+			     uint32_t last)
+{
+	uint32_t bno;
+	bool new;
+	int ret;
 
-		/* slice_to_write is 0 if we did not find a place to write our file in the block (we assume that the first bit is never free) */
-		while (slice_to_write == 0) {
-			/* Try fetch reference to next sliced block */
-			block_to_write = OUICHEFS_SLICED_BLOCK_SB_NEXT(bh_data);
+	/* ouichefs_map_blocks() leaves the blocks of delayed allocations alone */
+	while (first < last) {
+		new = false;
+		ret = ouichefs_map_blocks(inode, first, last - first, &bno,
+					  OUICHEFS_MAP_CREATE |
+						  OUICHEFS_MAP_UNWRITTEN,
+					  &new);
+		if (ret < 0)
+			return ret;
+		if (new)
+			ouichefs_release_delalloc(inode, first, first + ret - 1);
+		first += ret;
+	}
 
-			/* Store reference to the current block as previous */
-			bh_index = bh_data;
-			bh_data = NULL;
+	return 0;
+}
 
-			if (block_to_write == 0) {
-				/* No next sliced block, allocate a new one */
-				ssize_t free_block =
-					allocate_and_init_slice_block(sb, sbi,
-								      &bh_data);
-				if (free_block <= 0) {
-					ret = free_block;
-					pr_info("Failed to allocate new sliced block: %lx\n",
-						ret);
-					goto out;
-				}
-
-				block_to_write = (uint32_t)free_block;
-
-				/* Set pointer of previous block to this block */
-				OUICHEFS_SLICED_BLOCK_SB_SET_NEXT(bh_index,
-								  free_block);
-				mark_buffer_dirty(bh_index);
-				sync_dirty_buffer(bh_index);
-
-				/* Release the previous block - we're done with it */
-				brelse(bh_index);
-				bh_index = NULL;
-			} else {
-				/* Read the next block */
-				if (block_to_write == 0) {
-					pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
-					dump_stack();
-				}
-				bh_data = sb_bread(sb, block_to_write);
-				if (!bh_data) {
-					brelse(bh_index);
-					ret = -EIO;
-					goto out;
-				}
-
-				/* Release the previous block - we're done with it */
-				brelse(bh_index);
-				bh_index = NULL;
-			}
+/*
+ * Zero the bytes of a big file from start to end (excluded) that are before
+ * the end of file, through the page cache.
+ */
+static int ouichefs_zero_partial(struct inode *inode, loff_t start, loff_t end)
+{
+	end = min(end, i_size_read(inode));
+	if (start >= end)
+		return 0;
 
-			/* Check if this block has any empty slices */
-			slice_to_write = get_consequitive_free_slices(
-				&bh_data, ci, new_size);
-		}
-	} else {
-		pr_info("This is a small file that has already been added to a sliced block.\n");
-		uint32_t old_bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
-		uint32_t old_slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
-		uint32_t old_index_block = ci->index_block;
+	return iomap_zero_range(inode, start, end - start, NULL,
+				&ouichefs_iomap_ops);
+}
 
-		if (ci->num_slices == 0) {
-			pr_err("num_slices is 0, this should never be the case here!\n");
-			ret = -EIO;
-			goto out;
-		}
-		old_num_slices = ci->num_slices;
+/*
+ * Punch a hole in a big file from start to end (excluded). The blocks entirely
+ * in the range are freed, the partial ones at both ends are zeroed.
+ */
+static int ouichefs_punch_range(struct inode *inode, loff_t start, loff_t end)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	loff_t first = round_up(start, OUICHEFS_BLOCK_SIZE);
+	loff_t last = round_down(end, OUICHEFS_BLOCK_SIZE);
+	int ret;
 
-		pr_info("old_bno: %u, old_slice_no: %u\n", old_bno,
-			old_slice_no);
+	if (first > last) {
+		ret = ouichefs_zero_partial(inode, start, end);
+	} else {
+		ret = ouichefs_zero_partial(inode, start, first);
+		if (!ret)
+			ret = ouichefs_zero_partial(inode, last, end);
+	}
+	if (ret)
+		return ret;
 
-		if (old_bno == 0 || old_slice_no == 0) {
-			pr_err("bno or slice_no is 0, this should not happen!\n");
-			ret = -EIO;
-			goto out;
-		}
+	filemap_invalidate_lock(inode->i_mapping);
+	truncate_pagecache_range(inode, start, end - 1);
+	if (first < last) {
+		ouichefs_release_delalloc(inode, first >> blkbits,
+					  (last >> blkbits) - 1);
+		ret = ouichefs_update_blocks(inode, first >> blkbits,
+					     (last - first) >> blkbits, true);
+	}
+	filemap_invalidate_unlock(inode->i_mapping);
 
-		if (old_bno == 0) {
-			pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
-			dump_stack();
-		}
-		bh_data = sb_bread(sb, old_bno);
-		if (!bh_data) {
-			pr_err("Failed to read sliced block %u\n",
-			       block_to_write);
-			ret = -EIO;
-			goto out;
-		}
+	return ret;
+}
 
-		if (old_num_slices == new_num_slices) {
-			pr_info("unchanged amount of slices, just writing the file");
-			block_to_write = old_bno;
-			slice_to_write = old_slice_no;
-		} else {
-			ci->index_block = 0;
-			inode->i_size = 0;
+/*
+ * Preallocate space (mode 0 or FALLOC_FL_KEEP_SIZE), punch holes or zero a
+ * range of a file. Preallocated blocks are unwritten: they read as zeroes
+ * until data is written to them. Small files are zeroed in their slice, they
+ * are converted to big files when blocks are needed.
+ */
+static long ouichefs_fallocate(struct file *file, int mode, loff_t offset,
+			       loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	loff_t end = offset + len;
+	long ret;
 
-			struct iov_iter *new_iter = from;
-			struct kiocb *new_iocb = iocb;
-			// uint32_t num_slices = ci->num_slices;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
 
-			if (pos == 0) {
-				pr_info("pos is 0, we can ignore previous content");
-				ret = write_small_file(inode, ci, sb, sbi,
-						       new_iocb, new_iter);
-			} else {
-				/* Allocate buffer for the entire new file content */
-				char *combined_buf =
-					kmalloc(new_size, GFP_KERNEL);
-				if (!combined_buf) {
-					ret = -ENOMEM;
-					goto out;
-				}
-
-				/* Copy existing file data to the beginning of the buffer */
-				memcpy(combined_buf,
-				       bh_data->b_data +
-					       old_slice_no *
-						       OUICHEFS_SLICE_SIZE,
-				       old_size);
-
-				/* Zero-fill any gap between old data and write position */
-				if (pos > old_size) {
-					memset(combined_buf + old_size, 0,
-					       pos - old_size);
-				}
-
-				/* Copy new data from user space into the buffer */
-				size_t copied = copy_from_iter(
-					combined_buf + pos, count, from);
-				if (copied != count) {
-					ret = -EFAULT;
-					goto out;
-				}
-
-				struct kvec *kv = kmalloc(sizeof(struct kvec),
-							  GFP_KERNEL);
-				if (!kv) {
-					ret = -ENOMEM;
-					goto out;
-				}
-				kv->iov_base = combined_buf;
-				kv->iov_len = new_size;
-
-				/* Create iterator that contains the complete new file */
-				iov_iter_kvec(new_iter, READ, kv, 1, new_size);
-				new_iter->data_source = 1;
-
-				/* Reset position to 0 and remove append flag - we're writing entire file */
-				new_iocb->ki_pos = 0;
-				new_iocb->ki_flags &= ~IOCB_APPEND;
-
-				/* Write the entire new file content */
-				ret = write_small_file(inode, ci, sb, sbi,
-						       new_iocb, new_iter);
-
-				kfree(kv);
-				kfree(combined_buf);
-			}
+	inode_lock(inode);
 
-			if (ret > 0) {
-				/* Write was successful, update inode and delete old slices */
-				iocb->ki_pos = pos + count;
-				ret = count;
-				delete_slice(sb, sbi, old_bno, old_slice_no,
-					     old_num_slices);
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->i_size) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto unlock;
+	}
 
-			} else {
-				/* Write failed, restore old inode */
-				pr_err("Failed to write small file: %zd\n",
-				       ret);
+	ret = file_modified(file);
+	if (ret)
+		goto unlock;
 
-				ci->index_block = old_index_block;
-				inode->i_size = old_size;
-				iocb->ki_pos = pos;
-			}
-			return ret;
+	if (is_small_file(inode)) {
+		if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+			ret = ouichefs_zero_small_range(file, offset, end);
+			if (ret || (mode & FALLOC_FL_KEEP_SIZE) ||
+			    end <= inode->i_size)
+				goto unlock;
+		} else if (end <= inode->i_size) {
+			/* The slice already holds the whole file */
+			goto unlock;
 		}
+
+		ret = ouichefs_make_big(inode);
+		if (ret)
+			goto unlock;
 	}
 
-	if (!bh_data) {
-		/* We should have found a slice by now. If bh_data is null it means we have not. */
-		pr_err("bh_data is NULL, this should not happen!\n");
-		ret = -EIO;
-		goto out;
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+		ret = ouichefs_punch_range(inode, offset, end);
+		if (ret)
+			goto unlock;
 	}
 
-	pr_info("block_to_write: %d, slice to write: %d, pos: %llu\n",
-		block_to_write, slice_to_write, pos);
+	if (!(mode & FALLOC_FL_PUNCH_HOLE)) {
+		ret = ouichefs_prealloc(inode, offset >> inode->i_blkbits,
+					DIV_ROUND_UP(end, OUICHEFS_BLOCK_SIZE));
+		if (ret)
+			goto unlock;
+	}
 
-	/* Copy data from user space */
-	if (copy_from_iter(bh_data->b_data +
-				   slice_to_write * OUICHEFS_SLICE_SIZE + pos,
-			   count, from) != count) {
-		brelse(bh_data);
-		ret = -EFAULT;
-		goto out;
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->i_size) {
+		i_size_write(inode, end);
+		inode->i_blocks = DIV_ROUND_UP(end, OUICHEFS_BLOCK_SIZE) + 1;
+		mark_inode_dirty(inode);
 	}
 
-	pr_info("BEFORE sbi->nr_used_slices: %u\n", sbi->nr_used_slices);
-	sbi->nr_used_slices += new_num_slices;
-	pr_info("AFTER sbi->nr_used_slices: %u\n", sbi->nr_used_slices);
+unlock:
+	inode_unlock(inode);
 
-	/* Mark buffer dirty and sync */
-	mark_buffer_dirty(bh_data);
-	sync_dirty_buffer(bh_data);
-	brelse(bh_data);
-	bh_data = NULL;
-	ret = count;
+	return ret;
+}
 
-	/* Update inode metadata */
-	inode->i_size = new_size;
-	inode->i_mtime = inode->i_ctime = current_time(inode);
+/*
+ * SEEK_HOLE and SEEK_DATA walk the block map of big files through iomap. A
+ * small file is a single data extent, as generic_file_llseek() assumes.
+ */
+static loff_t ouichefs_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
 
-	ci->index_block = (block_to_write << 5) + slice_to_write;
-	pr_info("ci->index_block: %u\n\n", ci->index_block);
-	mark_inode_dirty(inode);
+	if (whence != SEEK_HOLE && whence != SEEK_DATA)
+		return generic_file_llseek(file, offset, whence);
 
-	/* Update file position */
-	iocb->ki_pos = pos;
+	inode_lock_shared(inode);
+	if (is_small_file(inode)) {
+		inode_unlock_shared(inode);
+		return generic_file_llseek(file, offset, whence);
+	}
 
-	goto out;
-out:
-	// pr_info("returning : %lx\n", ret);
-	if (bh_index)
-		brelse(bh_index);
-	if (bh_data)
-		brelse(bh_data);
+	if (whence == SEEK_HOLE)
+		offset = iomap_seek_hole(inode, offset, &ouichefs_iomap_ops);
+	else
+		offset = iomap_seek_data(inode, offset, &ouichefs_iomap_ops);
+	inode_unlock_shared(inode);
 
-	return ret;
+	if (offset < 0)
+		return offset;
+
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+static const struct vm_operations_struct ouichefs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ouichefs_page_mkwrite,
+};
+
+static int ouichefs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &ouichefs_file_vm_ops;
+
+	return 0;
 }
 
 const struct file_operations ouichefs_file_ops = {
 	.owner = THIS_MODULE,
-	.open = ouichefs_open,
-	.llseek = generic_file_llseek,
+	.llseek = ouichefs_llseek,
 	.read_iter = custom_read_iter,
 	.write_iter = custom_write_iter,
+	.splice_read = filemap_splice_read,
+	.mmap = ouichefs_file_mmap,
+	.fallocate = ouichefs_fallocate,
 	// .read_iter = generic_file_read_iter,
 	// .write_iter = generic_file_write_iter,
 	.fsync = generic_file_fsync,
@@ -36,6 +36,9 @@ struct dentry *ouichefs_mount(struct file_system_type *fs_type, int flags,
  */
 void ouichefs_kill_sb(struct super_block *sb)
 {
+	/* The compaction worker holds inodes, stop it before they go away */
+	if (sb->s_root)
+		ouichefs_stop_compaction(OUICHEFS_SB(sb));
 	kill_block_super(sb);
 
 	pr_info("unmounted disk\n");
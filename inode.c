@@ -9,12 +9,18 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/pagemap.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
+#include "ioctl.h"
 
 static const struct inode_operations ouichefs_inode_ops;
 
@@ -30,7 +36,7 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	struct buffer_head *bh = NULL;
 	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
 	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
-	int ret;
+	int ret, i;
 	
 
 	/* Fail if ino is out of range */
@@ -74,12 +80,18 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
 	ci->num_slices = le16_to_cpu(cinode->num_slices);
+	if (ouichefs_is_inline(inode))
+		memcpy(ci->i_data, cinode->i_data, OUICHEFS_INLINE_DATA_SIZE);
+	else
+		for (i = 0; i < OUICHEFS_NR_DIRECT_BLOCKS; i++)
+			ci->i_direct[i] = le32_to_cpu(cinode->i_direct[i]);
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
 	} else if (S_ISREG(inode->i_mode)) {
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
+		mapping_set_large_folios(inode->i_mapping);
 	}
 
 	brelse(bh);
@@ -192,6 +204,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		ci->index_block = 0;
 	}
 	ci->num_slices = 0;
+	memset(ci->i_direct, 0, sizeof(ci->i_direct));
 
 	/* Initialize inode */
 	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
@@ -204,6 +217,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		inode->i_size = 0;
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
+		mapping_set_large_folios(inode->i_mapping);
 	}
 	set_nlink(inode, 1);
 
@@ -317,6 +331,151 @@ end:
 	return ret;
 }
 
+/*
+ * Create the regular file described by rec in dir and register it in slot
+ * i of the directory index dblock. The directory block and the new inode
+ * are only dirtied, the caller flushes them.
+ */
+static int ingest_one(struct file *file, struct ouichefs_dir_block *dblock,
+		      int i, struct ouichefs_ingest_file *rec)
+{
+	struct inode *dir = file_inode(file);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct dentry *dentry;
+	struct inode *inode;
+	void *data = NULL;
+	size_t len;
+	int ret;
+
+	len = strnlen(rec->name, sizeof(rec->name));
+	if (len > OUICHEFS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+	if (!len || strchr(rec->name, '/'))
+		return -EINVAL;
+	if (rec->mode & ~S_IALLUGO)
+		return -EINVAL;
+	if (rec->size > OUICHEFS_SMALL_FILE_MAX_SIZE)
+		return -EFBIG;
+	if (i == OUICHEFS_MAX_SUBFILES)
+		return -EMLINK;
+
+	if (rec->size) {
+		data = memdup_user(rec->data, rec->size);
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+	}
+
+	dentry = lookup_one_len(rec->name, file->f_path.dentry, len);
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto free;
+	}
+	if (d_really_is_positive(dentry)) {
+		ret = -EEXIST;
+		goto dput;
+	}
+
+	inode = ouichefs_new_inode(dir, S_IFREG | rec->mode);
+	if (IS_ERR(inode)) {
+		ret = PTR_ERR(inode);
+		goto dput;
+	}
+	ret = ouichefs_fill_small_file(inode, dir, data, rec->size);
+	if (ret) {
+		/* Evict it now, its number may be handed out again */
+		clear_nlink(inode);
+		put_inode(sbi, inode->i_ino);
+		iput(inode);
+		goto dput;
+	}
+
+	dblock->files[i].inode = cpu_to_le32(inode->i_ino);
+	strscpy(dblock->files[i].filename, rec->name, OUICHEFS_FILENAME_LEN);
+
+	/* Copy the inode to its buffer, the caller syncs the device */
+	mark_inode_dirty(inode);
+	write_inode_now(inode, 0);
+	d_instantiate(dentry, inode);
+dput:
+	dput(dentry);
+free:
+	kfree(data);
+	return ret;
+}
+
+/*
+ * Create a batch of small files in the directory opened as file. Unlike a
+ * loop of creat() and write(), the directory index is read and dirtied once,
+ * the slices of the files are packed next to each other and nothing is
+ * synced until all files exist, then the device is flushed once.
+ * Returns the number of files created, or an error if none was.
+ */
+long ouichefs_ingest(struct file *file, void __user *argp)
+{
+	struct ouichefs_ingest_ioctl __user *uarg = argp;
+	struct ouichefs_ingest_ioctl arg;
+	struct ouichefs_ingest_file rec;
+	struct inode *dir = file_inode(file);
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	unsigned int n = 0;
+	int ret, i;
+
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		return -EFAULT;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+	inode_lock(dir);
+
+	ret = inode_permission(file_mnt_idmap(file), dir, MAY_WRITE | MAY_EXEC);
+	if (ret)
+		goto unlock;
+
+	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+	/* Entries are packed, new files go after the last one */
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
+		if (dblock->files[i].inode == 0)
+			break;
+
+	for (; n < arg.nr_files; n++, i++) {
+		if (copy_from_user(&rec, &arg.files[n], sizeof(rec))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = ingest_one(file, dblock, i, &rec);
+		if (ret)
+			break;
+	}
+
+	if (n) {
+		mark_buffer_dirty(bh);
+		dir->i_mtime = dir->i_ctime = current_time(dir);
+		mark_inode_dirty(dir);
+		write_inode_now(dir, 0);
+	}
+	brelse(bh);
+unlock:
+	inode_unlock(dir);
+	mnt_drop_write_file(file);
+
+	if (!n)
+		return ret;
+
+	sync_blockdev(sb->s_bdev);
+	if (put_user(n, &uarg->nr_created))
+		return -EFAULT;
+	return n;
+}
+
 /*
  * Remove a link for a file. If link count is 0, destroy file in this way:
  *	 - remove the file from its parent directory.
@@ -330,9 +489,8 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct inode *inode = d_inode(dentry);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
+	struct buffer_head *bh = NULL;
 	struct ouichefs_dir_block *dir_block = NULL;
-	struct ouichefs_file_index_block *file_block = NULL;
 	uint32_t ino, bno;
 	int i, f_id = -1, nr_subs = 0;
 
@@ -377,8 +535,7 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	/*
 	* Cleanup pointed blocks if unlinking a file. If we fail to read the
 	* index block, cleanup inode anyway and lose this file's blocks
-	 * forever. If we fail to scrub a data block, don't fail (too late
-	 * anyway), just put the block and continue.
+	 * forever.
 	 */
 
 	bool is_dir = S_ISDIR(inode->i_mode);
@@ -386,6 +543,13 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	pr_info("small_file: %d, inode->i_blocks: %llu, ci->index_block: %u, !is_dir: %d\n",
 		small_file, inode->i_blocks, ci->index_block, !is_dir);
 
+	/*
+	 * Dirty pages must not be written back to blocks we are about to
+	 * free, drop them now.
+	 */
+	if (!is_dir)
+		truncate_inode_pages(&inode->i_data, 0);
+
 	if (small_file) {
 		delete_slice_and_clear_inode(ci, sb, sbi);
 		pr_info("(sbi->nr_blocks - sbi->nr_free_blocks) * BLOCK_SIZE: %u\n",
@@ -393,45 +557,32 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 		goto clean_inode;
 	}
 
+	if (!is_dir) {
+		/*
+		 * Free the data blocks whatever the index format. Blocks are
+		 * not scrubbed: new data blocks are zeroed by iomap and new
+		 * index blocks when they are allocated.
+		 */
+		ouichefs_free_data_blocks(inode);
+		goto clean_inode;
+	}
+
 	if (bno == 0) {
 		panic("bno zero first");
 	}
+
+	/* Scrub directory block */
 	bh = sb_bread(sb, bno);
 	if (!bh)
 		goto clean_inode;
-	file_block = (struct ouichefs_file_index_block *)bh->b_data;
-	if (S_ISDIR(inode->i_mode))
-		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if (!file_block->blocks[i])
-			continue;
-
-		if (le32_to_cpu(file_block->blocks[i]) == 0) {
-			pr_err("CRITICAL: Attempted to access block 0 (superblock) as data block!\n");
-			dump_stack();
-		}
-		bh2 = sb_bread(sb, le32_to_cpu(file_block->blocks[i]));
-		if (!bh2)
-			goto put_block;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-put_block:
-		put_block(sbi, le32_to_cpu(file_block->blocks[i]));
-	}
-
-scrub:
-	/* Scrub index block */
-	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
 	mark_buffer_dirty(bh);
 	sync_dirty_buffer(bh);
 	brelse(bh);
 
 clean_inode:
 	/* Cleanup inode and mark dirty */
+	ouichefs_drop_block_map(inode);
 	inode->i_blocks = 0;
 	OUICHEFS_INODE(inode)->index_block = 0;
 	inode->i_size = 0;
@@ -445,9 +596,17 @@ clean_inode:
 	inode_dec_link_count(inode);
 	mark_inode_dirty(inode);
 
-	/* Free inode and index block from bitmap */
-	if (bno != 0 && !small_file)
+	/*
+	 * Free inode and directory block from bitmap (the blocks of a file
+	 * were freed above). The block buffer may still be dirty, forget it so
+	 * that it does not overwrite the block once it is reused.
+	 */
+	if (is_dir) {
+		bh = sb_find_get_block(sb, bno);
+		if (bh)
+			bforget(bh);
 		put_block(sbi, bno);
+	}
 
 	put_inode(sbi, ino);
 
@@ -599,6 +758,33 @@ static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 	return ouichefs_unlink(dir, dentry);
 }
 
+/*
+ * Change the attributes of an inode. Size changes of regular files free or
+ * zero their data, see ouichefs_truncate().
+ */
+static int ouichefs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
+			    struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	int ret;
+
+	ret = setattr_prepare(idmap, dentry, iattr);
+	if (ret)
+		return ret;
+
+	if ((iattr->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode) &&
+	    iattr->ia_size != inode->i_size) {
+		ret = ouichefs_truncate(inode, iattr->ia_size);
+		if (ret)
+			return ret;
+	}
+
+	setattr_copy(idmap, inode, iattr);
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
 static const struct inode_operations ouichefs_inode_ops = {
 	.lookup = ouichefs_lookup,
 	.create = ouichefs_create,
@@ -606,4 +792,5 @@ static const struct inode_operations ouichefs_inode_ops = {
 	.mkdir = ouichefs_mkdir,
 	.rmdir = ouichefs_rmdir,
 	.rename = ouichefs_rename,
+	.setattr = ouichefs_setattr,
 };
@@ -18,11 +18,6 @@ static long ouichefs_ioctl(struct file *dev_file, unsigned int cmd, unsigned lon
 				return -EFAULT;
 		}
 
-		if (!value.data) {
-			pr_err("data should not be null");
-			return -EINVAL;
-		}
-
 		struct file *file = fget(value.target_file);
 		if (!file) {
 			pr_err("File not found");
@@ -32,32 +27,40 @@ static long ouichefs_ioctl(struct file *dev_file, unsigned int cmd, unsigned lon
 		struct super_block *sb = inode->i_sb;
 		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 		struct buffer_head *bh_data;
+		long ret = 0;
 
 		// TODO: check if file is from ouichefs
 
-		if (inode->i_blocks != 0) {
+		if (inode->i_blocks != 0 || !ci->index_block) {
 			pr_err("Not a sliced file");
-			return -EINVAL;
+			ret = -EINVAL;
+			goto out;
 		}
 
-		uint32_t bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
-		uint32_t slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
-
-		pr_info("requested file is in slice_no: %u\n", slice_no);
-
-		bh_data = sb_bread(sb, bno);
-		if (!bh_data) {
-			pr_err("Failed to read sliced block %u\n", bno);
-			return -EIO;
-		}
-
-		if (copy_to_user(value.data, bh_data->b_data, OUICHEFS_SLICE_SIZE * 32)) {
-				pr_err("Failed to write value\n");
-				return -EFAULT;
+		value.bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
+		value.slice_no = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
+
+		/* The content of the sliced block is only copied if asked for */
+		if (value.data) {
+			bh_data = sb_bread(sb, value.bno);
+			if (!bh_data) {
+				pr_err("Failed to read sliced block %u\n",
+				       value.bno);
+				ret = -EIO;
+				goto out;
+			}
+			if (copy_to_user(value.data, bh_data->b_data,
+					 OUICHEFS_SLICE_SIZE * 32))
+				ret = -EFAULT;
+			brelse(bh_data);
 		}
 
-		brelse(bh_data);
-		return 0;
+		if (!ret && copy_to_user((struct ouichefs_debug_ioctl *)arg,
+					 &value, sizeof(value)))
+			ret = -EFAULT;
+out:
+		fput(file);
+		return ret;
 	} else {
 		pr_info("Not a command\n");
 
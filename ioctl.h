@@ -1,7 +1,67 @@
-#define OUICHEFS_DEBUG_IOCTL _IOR('o', 0, struct ouichefs_debug_ioctl)
+#define OUICHEFS_DEBUG_IOCTL _IOWR('o', 0, struct ouichefs_debug_ioctl)
 
+/*
+ * Issued on /dev/ouichefs: give the location of the small file open as
+ * target_file, and the content of its sliced block if data is not NULL.
+ */
 struct ouichefs_debug_ioctl {
 	int target_file;
 	char *data;
+	unsigned int bno; /* Sliced block of the file */
+	unsigned int slice_no; /* First slice of the file in it */
 };
 
+
+#define OUICHEFS_INGEST_IOCTL _IOWR('o', 1, struct ouichefs_ingest_ioctl)
+
+/* Longest file name, also defined in ouichefs.h for the kernel side */
+#ifndef OUICHEFS_FILENAME_LEN
+#define OUICHEFS_FILENAME_LEN 28
+#endif
+
+/* One small file to create, name is NUL terminated */
+struct ouichefs_ingest_file {
+	char name[OUICHEFS_FILENAME_LEN + 1];
+	unsigned int mode;
+	unsigned int size;
+	char *data;
+};
+
+/*
+ * Issued on a directory: create nr_files files in it. Returns the number of
+ * files created, also stored in nr_created; creation stops at the first
+ * failing record.
+ */
+struct ouichefs_ingest_ioctl {
+	unsigned int nr_files;
+	unsigned int nr_created;
+	struct ouichefs_ingest_file *files;
+};
+
+#define OUICHEFS_READ_BATCH_IOCTL \
+	_IOWR('o', 2, struct ouichefs_read_batch_ioctl)
+
+/*
+ * One file of the directory to read, by inode number if ino is not 0, by
+ * name otherwise. On return, its content is at offset in the buffer and
+ * size is its length, or a negative errno if it could not be read.
+ */
+struct ouichefs_read_file {
+	char name[28];
+	unsigned int ino;
+	unsigned int offset;
+	int size;
+};
+
+/*
+ * Issued on a directory: read the nr_files small files described by files
+ * into buf, which holds buf_size bytes. Contents are packed in the order
+ * the files are stored on disk, not in the order of the array. Returns the
+ * number of files read.
+ */
+struct ouichefs_read_batch_ioctl {
+	unsigned int nr_files;
+	unsigned int buf_size;
+	struct ouichefs_read_file *files;
+	char *buf;
+};
@@ -16,9 +16,11 @@
 #define OUICHEFS_SB_BLOCK_NR 0
 
 #define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+#define OUICHEFS_MAX_FILESIZE UINT32_MAX /* i_size is 32 bits on disk */
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
+#define OUICHEFS_NR_DIRECT_BLOCKS 12
+#define OUICHEFS_NR_SLICE_CLASSES 4
 
 struct ouichefs_inode {
 	mode_t i_mode; /* File mode */
@@ -35,6 +37,7 @@ struct ouichefs_inode {
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
 	uint16_t num_slices; /* Number of slices for a small file (big files ignore this) */
+	uint32_t i_direct[OUICHEFS_NR_DIRECT_BLOCKS]; /* First data blocks of a big file */
 };
 
 #define OUICHEFS_INODES_PER_BLOCK \
@@ -58,9 +61,18 @@ struct ouichefs_superblock {
 
 	uint32_t s_free_sliced_blocks; /* Number of the first free sliced block (0 if there is none) */
 
-	char padding[4052]; /* Padding to match block size */
+	uint32_t s_features; /* OUICHEFS_FEATURE_* flags */
+
+	uint32_t s_free_sliced_classes[OUICHEFS_NR_SLICE_CLASSES - 1]; /* First sliced block of the other slice classes */
+
+	char padding[4036]; /* Padding to match block size */
 };
 
+/* Big files are indexed by extents instead of one block number per block */
+#define OUICHEFS_FEATURE_EXTENTS (1 << 0)
+/* 128-byte inodes with direct blocks or inline data, always set */
+#define OUICHEFS_FEATURE_INODE128 (1 << 1)
+
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
@@ -76,7 +88,8 @@ static inline void usage(char *appname)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
+		"%s [-e] disk\n"
+		"\t-e: index big files by extents instead of block lists\n",
 		appname);
 }
 
@@ -90,7 +103,8 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 }
 
 static struct ouichefs_superblock *write_superblock(int fd,
-						    uint64_t partition_size)
+						    uint64_t partition_size,
+						    uint32_t features)
 {
 	int ret;
 	struct ouichefs_superblock *sb;
@@ -125,6 +139,7 @@ static struct ouichefs_superblock *write_superblock(int fd,
 	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
 	sb->nr_used_slices = htole32(0);
 	sb->s_free_sliced_blocks = htole32(0);
+	sb->s_features = htole32(features);
 
 	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
 	if (ret != sizeof(struct ouichefs_superblock)) {
@@ -139,12 +154,14 @@ static struct ouichefs_superblock *write_superblock(int fd,
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tfeatures=%#x\n",
 	       sizeof(struct ouichefs_superblock), le32toh(sb->magic),
 		   le32toh(sb->nr_blocks), le32toh(sb->nr_inodes),
 		   le32toh(sb->nr_istore_blocks),
 		   le32toh(sb->nr_ifree_blocks), le32toh(sb->nr_bfree_blocks),
-		   le32toh(sb->nr_free_inodes), le32toh(sb->nr_free_blocks));
+		   le32toh(sb->nr_free_inodes), le32toh(sb->nr_free_blocks),
+		   le32toh(sb->s_features));
 
 	return sb;
 }
@@ -372,14 +389,27 @@ int main(int argc, char **argv)
 	uint64_t partition_size = 0;
 	struct stat stat_buf;
 	struct ouichefs_superblock *sb = NULL;
+	uint32_t features = OUICHEFS_FEATURE_INODE128;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e")) != -1) {
+		switch (opt) {
+		case 'e':
+			features |= OUICHEFS_FEATURE_EXTENTS;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
 
-	if (argc != 2 || argv[1][0] == '-') {
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
 	/* Open disk partition */
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open()");
 		return EXIT_FAILURE;
@@ -416,7 +446,7 @@ int main(int argc, char **argv)
 	}
 
 	/* Write superblock (block 0) */
-	sb = write_superblock(fd, partition_size);
+	sb = write_superblock(fd, partition_size, features);
 	if (!sb) {
 		perror("write_superblock()");
 		ret = EXIT_FAILURE;
@@ -8,17 +8,41 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
 #define OUICHEFS_SB_BLOCK_NR 0
 
 #define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+#define OUICHEFS_MAX_FILESIZE U32_MAX /* i_size is 32 bits on disk */
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
-#define OUICHEFS_SLICE_SIZE 128
-#define OUICHEFS_SLICES_PER_SLICED_BLOCK 31 
+#define OUICHEFS_SLICE_SIZE 128 /* Also the size of the sliced block header */
+#define OUICHEFS_SLICES_PER_SLICED_BLOCK 31 /* Slices of class 0 */
+#define OUICHEFS_SMALL_FILE_MAX_SIZE \
+	(OUICHEFS_BLOCK_SIZE - OUICHEFS_SLICE_SIZE) /* Larger files are big */
+#define OUICHEFS_NR_DIRECT_BLOCKS 12 /* Blocks mapped by the inode itself */
+#define OUICHEFS_INLINE_DATA_SIZE \
+	(OUICHEFS_NR_DIRECT_BLOCKS * 4) /* Files stored in place of i_direct */
+
+/*
+ * Slice size classes. A sliced block holds the slices of a single class
+ * after its 128-byte header: 31 slices of 128 bytes for class 0, then 16 of
+ * 248, 8 of 496 and 4 of 992 bytes. Slice n (counted from 1) starts at
+ * 128 + (n - 1) * size. A small file goes to the smallest class in which it
+ * takes at most OUICHEFS_SLICE_CLASS_MAX_SLICES slices.
+ */
+#define OUICHEFS_NR_SLICE_CLASSES 4
+#define OUICHEFS_SLICE_CLASS_MAX_SLICES 4
+#define OUICHEFS_SLICE_CLASS_NR(c) \
+	((c) ? 32U >> (c) : OUICHEFS_SLICES_PER_SLICED_BLOCK)
+#define OUICHEFS_SLICE_CLASS_SIZE(c) \
+	((OUICHEFS_BLOCK_SIZE - OUICHEFS_SLICE_SIZE) / OUICHEFS_SLICE_CLASS_NR(c))
+
+/* Sliced blocks track their slices in a 32-bit bitmap, bit 0 is the header */
+#define OUICHEFS_BITMAP_SIZE_BITS (sizeof(uint32_t) * 8)
 
 /*
  * ouiche_fs partition layout
@@ -53,17 +77,35 @@ struct ouichefs_inode {
 	__le32 i_nlink; /* Hard links count */
 	__le32 index_block; /* Block with list of blocks for this file */
 	__le16 num_slices; /* Number of slices for a small file (big files ignore this) */
+	union {
+		__le32 i_direct[OUICHEFS_NR_DIRECT_BLOCKS]; /* First data blocks of a big file */
+		char i_data[OUICHEFS_INLINE_DATA_SIZE]; /* Data of an inline file */
+	};
 };
 
 struct ouichefs_inode_info {
 	uint16_t num_slices; /* Number of slices for a small file (big files ignore this) */
-	uint32_t index_block;
+	uint32_t index_block; /* 0 for a big file that fits in its direct blocks */
+	union {
+		uint32_t i_direct[OUICHEFS_NR_DIRECT_BLOCKS]; /* Protected by block_map_lock */
+		char i_data[OUICHEFS_INLINE_DATA_SIZE]; /* Inline files, protected by the inode lock */
+	};
+	uint32_t *block_map; /* In-memory copy of the index block (big files), NULL until first use */
+	uint32_t *ind_map; /* In-memory copy of the single indirect block, NULL until first use */
+	uint32_t *dind_map; /* In-memory copy of the double indirect block, NULL until first use */
+	struct mutex block_map_lock; /* Protects block_map and the index block */
+	struct xarray i_delalloc; /* Blocks reserved by buffered writes but not allocated yet */
+	uint32_t i_delalloc_ind; /* Reserved blocks past the direct ones, protected by block_map_lock */
+	uint32_t i_meta_reserved; /* Index blocks reserved to map them, protected by block_map_lock */
+	uint32_t i_slice_hint[OUICHEFS_NR_SLICE_CLASSES]; /* Directories: sliced block last used by a child, per class */
 	struct inode vfs_inode;
 };
 
 #define OUICHEFS_INODES_PER_BLOCK \
 	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
 
+struct ouichefs_slice_pool;
+
 struct ouichefs_sb_info {
 	uint32_t magic; /* Magic number */
 
@@ -82,16 +124,84 @@ struct ouichefs_sb_info {
 
 	uint32_t s_free_sliced_blocks; /* Number of the first free sliced block (0 if there is none) */
 
+	uint32_t s_features; /* OUICHEFS_FEATURE_* flags, set by mkfs */
+
+	uint32_t s_free_sliced_classes[OUICHEFS_NR_SLICE_CLASSES - 1]; /* First sliced block of the other classes */
+
 	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
 	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
 
+	uint32_t s_reserved_blocks; /* Free blocks promised to delayed allocations */
+	spinlock_t s_alloc_lock; /* Protects the free bitmaps and counters, and s_reserved_blocks */
+
+	struct mutex s_slice_lock; /* Protects the sliced block mirror and chain heads */
+	struct xarray s_sliced; /* Sliced block number -> mirrored header (see slice.c) */
+	struct list_head s_sliced_runs[OUICHEFS_NR_SLICE_CLASSES]
+				      [OUICHEFS_BITMAP_SIZE_BITS]; /* Sliced blocks by class and longest free run */
+	struct ouichefs_slice_pool __percpu *s_slice_pools; /* Current sliced blocks of each CPU */
+	struct delayed_work s_compact_work; /* Sliced block compaction */
+	bool s_compact_stopped; /* Set at unmount, protected by s_slice_lock */
+
 	struct kobject s_kobj; /* sysfs kobject */
 	struct super_block *
 		s_sb; /* Containing super_block reference  TODO: is this okay? */
 };
 
+/* Big files are indexed by extents instead of one block number per block */
+#define OUICHEFS_FEATURE_EXTENTS (1 << 0)
+/* 128-byte inodes with direct blocks or inline data, required to mount */
+#define OUICHEFS_FEATURE_INODE128 (1 << 1)
+#define OUICHEFS_FEATURES_KNOWN \
+	(OUICHEFS_FEATURE_EXTENTS | OUICHEFS_FEATURE_INODE128)
+
+#define OUICHEFS_HAS_EXTENTS(sbi) ((sbi)->s_features & OUICHEFS_FEATURE_EXTENTS)
+
+#define OUICHEFS_INDEX_ENTRIES (OUICHEFS_BLOCK_SIZE >> 2)
+
+/*
+ * Flat index block: the first OUICHEFS_INDEX_DIRECT entries point to data
+ * blocks. The last two point to a single indirect block (an array of data
+ * block numbers) and to a double indirect block (an array of single indirect
+ * blocks).
+ */
+#define OUICHEFS_INDEX_DIRECT (OUICHEFS_INDEX_ENTRIES - 2)
+#define OUICHEFS_INDEX_IND (OUICHEFS_INDEX_ENTRIES - 2)
+#define OUICHEFS_INDEX_DIND (OUICHEFS_INDEX_ENTRIES - 1)
+
+/*
+ * Blocks preallocated by fallocate() but not written yet read as zeroes. They
+ * are flagged by the top bit of their flat index entry (or direct pointer),
+ * or of the ee_len of their extent.
+ */
+#define OUICHEFS_UNWRITTEN (1U << 31)
+
 struct ouichefs_file_index_block {
-	__le32 blocks[OUICHEFS_BLOCK_SIZE >> 2];
+	__le32 blocks[OUICHEFS_INDEX_ENTRIES];
+};
+
+struct ouichefs_extent {
+	__le32 ee_block; /* First file block covered by the extent */
+	__le32 ee_start; /* First physical block */
+	__le32 ee_len; /* Number of blocks, OUICHEFS_UNWRITTEN if not written */
+};
+
+#define OUICHEFS_EXTENTS_PER_BLOCK \
+	((OUICHEFS_BLOCK_SIZE - sizeof(__le32)) / sizeof(struct ouichefs_extent))
+
+/* Index block of a file with the extents feature, extents sorted by ee_block */
+struct ouichefs_file_extent_block {
+	__le32 nr_extents;
+	struct ouichefs_extent extents[OUICHEFS_EXTENTS_PER_BLOCK];
+};
+
+/* In-memory copy of struct ouichefs_file_extent_block, in CPU byte order */
+struct ouichefs_extent_map {
+	uint32_t nr_extents;
+	struct ouichefs_mem_extent {
+		uint32_t block;
+		uint32_t start;
+		uint32_t len;
+	} extents[OUICHEFS_EXTENTS_PER_BLOCK];
 };
 
 struct ouichefs_dir_block {
@@ -101,12 +211,16 @@ struct ouichefs_dir_block {
 	} files[OUICHEFS_MAX_SUBFILES];
 };
 
-#define OUICHEFS_BITMAP_SIZE_BITS (sizeof(uint32_t) * 8)
 #define OUICHEFS_BITMAP_ALL_FREE \
 	4294967294 /* unsigned 32 bit number. 31 '1' bits and 1 '0' */
 
-#define OUICHEFS_BITMAP_IS_ALL_FREE(bh) \
-	(OUICHEFS_SLICED_BLOCK_SB_BITMAP(bh) == OUICHEFS_BITMAP_ALL_FREE)
+/* Bitmap of an empty sliced block of class c: bits 1 to the number of slices */
+#define OUICHEFS_BITMAP_CLASS_ALL_FREE(c) \
+	((uint32_t)((1ULL << OUICHEFS_SLICE_CLASS_NR(c)) - 1) << 1)
+
+#define OUICHEFS_BITMAP_IS_ALL_FREE(bh)          \
+	(OUICHEFS_SLICED_BLOCK_SB_BITMAP(bh) ==   \
+	 OUICHEFS_BITMAP_CLASS_ALL_FREE(OUICHEFS_SLICED_BLOCK_SB_CLASS(bh)))
 
 /* Finds the first set bit (1) out of the first 32 bits and clears it (0). 
    Bit 0 is the first bit and is always 0, and can this be used to indicate 
@@ -126,6 +240,16 @@ struct ouichefs_dir_block {
 #define OUICHEFS_SLICED_BLOCK_SB_SET_NEXT(bh, val) \
 	(*((uint32_t *)((bh)->b_data + 4)) = (val))
 
+#define OUICHEFS_SLICED_BLOCK_SB_CLASS(bh) (*((uint32_t *)((bh)->b_data + 8)))
+
+#define OUICHEFS_SLICED_BLOCK_SB_SET_CLASS(bh, val) \
+	(*((uint32_t *)((bh)->b_data + 8)) = (val))
+
+#define OUICHEFS_SLICED_BLOCK_SB_PREV(bh) (*((uint32_t *)((bh)->b_data + 12)))
+
+#define OUICHEFS_SLICED_BLOCK_SB_SET_PREV(bh, val) \
+	(*((uint32_t *)((bh)->b_data + 12)) = (val))
+
 /* small file index_block getters */
 #define OUICHEFS_SMALL_FILE_GET_BNO(inode) \
 	((inode->index_block) >> 5) /* Get the number of the block (27 bits)*/
@@ -141,11 +265,43 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
+long ouichefs_ingest(struct file *file, void __user *argp);
+
+/* dir functions */
+long ouichefs_read_batch(struct file *file, void __user *argp);
 
 /* file functions */
+struct buffer_head;
 extern const struct file_operations ouichefs_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
+void ouichefs_drop_block_map(struct inode *inode);
+int ouichefs_free_data_blocks(struct inode *inode);
+void ouichefs_release_delalloc(struct inode *inode, uint32_t first,
+			       uint32_t last);
+int ouichefs_truncate(struct inode *inode, loff_t newsize);
+int ouichefs_fill_small_file(struct inode *inode, struct inode *dir,
+			     const void *data, size_t size);
+ssize_t ouichefs_read_small_file(struct inode *inode, struct buffer_head **bh,
+				 void *buf);
+
+/* sliced block headers, mirrored in memory */
+int ouichefs_init_slice_index(struct super_block *sb);
+void ouichefs_destroy_slice_index(struct ouichefs_sb_info *sbi);
+int ouichefs_slice_add(struct ouichefs_sb_info *sbi, uint32_t bno,
+		       uint32_t class);
+uint32_t ouichefs_slice_alloc(struct ouichefs_sb_info *sbi, uint32_t class,
+			      uint32_t nr_slices, uint32_t hint, uint32_t *bno);
+bool ouichefs_slice_grow(struct ouichefs_sb_info *sbi, uint32_t bno,
+			 uint32_t slice_no, uint32_t old_nr, uint32_t new_nr);
+bool ouichefs_slice_free(struct ouichefs_sb_info *sbi, uint32_t bno,
+			 uint32_t slice_no, uint32_t nr_slices);
+void ouichefs_slice_write_header(struct ouichefs_sb_info *sbi,
+				 struct buffer_head *bh);
+int ouichefs_sync_slice_headers(struct super_block *sb);
+uint32_t ouichefs_slice_free_count(struct ouichefs_sb_info *sbi);
+void ouichefs_compact_slices(struct ouichefs_sb_info *sbi);
+void ouichefs_stop_compaction(struct ouichefs_sb_info *sbi);
 
 /* sysfs */
 extern int ouichefs_register_sysfs(struct super_block *sb);
@@ -162,6 +318,16 @@ extern void ouichefs_unregister_device(void);
 #define OUICHEFS_INODE(inode) \
 	(container_of(inode, struct ouichefs_inode_info, vfs_inode))
 
+/*
+ * A small file (no block) without a slice but with data is an inline file:
+ * its data is kept in the inode itself, in place of the direct blocks.
+ */
+static inline bool ouichefs_is_inline(struct inode *inode)
+{
+	return S_ISREG(inode->i_mode) && inode->i_blocks == 0 &&
+	       OUICHEFS_INODE(inode)->index_block == 0 && inode->i_size > 0;
+}
+
 /**
  * @brief Deletes a slice and clears data in sliced block. 
  * This function also checks if the sliced block is now completely vacant
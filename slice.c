@@ -0,0 +1,750 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/list.h>
+#include <linux/pagemap.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/* Delay before compacting the sliced blocks after one became sparse */
+#define OUICHEFS_COMPACT_DELAY (30 * HZ)
+
+/*
+ * In-memory mirror of the headers of the sliced blocks. Each sliced block has
+ * an entry holding its bitmap and chain pointers, and is kept in the bucket
+ * of its class and of the longest run of free slices in its bitmap, so that a
+ * block with room for n consecutive slices is found by looking at the first
+ * non-empty bucket from n up. Slices are allocated and freed in the mirror
+ * without reading any block: a sliced block is only read when its slice data
+ * is accessed. The mirror is built at mount time from the sliced block chains
+ * and is the reference from then on. Headers changed in it are written back
+ * when their block is next written, or by ouichefs_sync_slice_headers().
+ *
+ * So that concurrent small file creations do not all wait on s_slice_lock,
+ * each CPU has a pool holding its current sliced block of each class, taken
+ * out of the buckets. Slices are claimed from it under the lock of the pool
+ * only. When it has no room left, the block goes back to the buckets and the
+ * pool takes the best fitting block from them, under s_slice_lock. A block
+ * emptied while a pool owns it leaves the pool and is freed like any other.
+ */
+struct ouichefs_slice_pool {
+	spinlock_t lock;
+	struct ouichefs_sliced_block *cur[OUICHEFS_NR_SLICE_CLASSES];
+};
+
+struct ouichefs_sliced_block {
+	struct list_head list; /* In its bucket of sbi->s_sliced_runs */
+	uint32_t bno;
+	uint32_t class;
+	uint32_t bitmap; /* Free slices */
+	uint32_t next; /* Next and previous sliced blocks of the chain */
+	uint32_t prev;
+	uint32_t run; /* Longest run of free slices */
+	bool dirty; /* Header not written back to the block yet */
+	bool draining; /* Being emptied by compaction, out of the buckets */
+	struct ouichefs_slice_pool *pool; /* CPU pool owning it, out of the buckets */
+};
+
+/*
+ * The bitmap and dirty flag of a block owned by a pool are protected by the
+ * lock of the pool, those of the other blocks by s_slice_lock. The owner of a
+ * block only changes with both held, so it is stable under s_slice_lock.
+ */
+static void sblock_lock(struct ouichefs_sliced_block *sblock)
+{
+	if (sblock->pool)
+		spin_lock(&sblock->pool->lock);
+}
+
+static void sblock_unlock(struct ouichefs_sliced_block *sblock)
+{
+	if (sblock->pool)
+		spin_unlock(&sblock->pool->lock);
+}
+
+/* Head of the chain of the sliced blocks of class */
+static uint32_t *slice_chain(struct ouichefs_sb_info *sbi, uint32_t class)
+{
+	return class ? &sbi->s_free_sliced_classes[class - 1] :
+		       &sbi->s_free_sliced_blocks;
+}
+
+/* Length of the longest run of set (free) bits in bitmap */
+static uint32_t longest_free_run(uint32_t bitmap)
+{
+	uint32_t run = 0;
+
+	while (bitmap) {
+		bitmap &= bitmap << 1;
+		run++;
+	}
+
+	return run;
+}
+
+/* Move sblock to the bucket matching its bitmap, marking its header dirty */
+static void sblock_changed(struct ouichefs_sb_info *sbi,
+			   struct ouichefs_sliced_block *sblock)
+{
+	sblock->run = longest_free_run(sblock->bitmap);
+	sblock->dirty = true;
+	if (!sblock->draining && !sblock->pool)
+		list_move(&sblock->list,
+			  &sbi->s_sliced_runs[sblock->class][sblock->run]);
+}
+
+static uint32_t sblock_used(struct ouichefs_sliced_block *sblock)
+{
+	return OUICHEFS_SLICE_CLASS_NR(sblock->class) -
+	       hweight32(sblock->bitmap);
+}
+
+/* A sliced block at most half full is worth emptying into the others */
+static bool sblock_sparse(struct ouichefs_sliced_block *sblock)
+{
+	return sblock_used(sblock) * 2 <= OUICHEFS_SLICE_CLASS_NR(sblock->class);
+}
+
+static int sblock_insert(struct ouichefs_sb_info *sbi, uint32_t bno,
+			 uint32_t class, uint32_t bitmap, uint32_t next,
+			 uint32_t prev, bool dirty)
+{
+	struct ouichefs_sliced_block *sblock;
+
+	sblock = kmalloc(sizeof(*sblock), GFP_NOFS);
+	if (!sblock)
+		return -ENOMEM;
+	sblock->bno = bno;
+	sblock->class = class;
+	sblock->bitmap = bitmap;
+	sblock->next = next;
+	sblock->prev = prev;
+	sblock->draining = false;
+	sblock->pool = NULL;
+	INIT_LIST_HEAD(&sblock->list);
+	if (xa_err(xa_store(&sbi->s_sliced, bno, sblock, GFP_NOFS))) {
+		kfree(sblock);
+		return -ENOMEM;
+	}
+	sblock_changed(sbi, sblock);
+	sblock->dirty = dirty;
+
+	return 0;
+}
+
+/*
+ * Add the new sliced block bno of class at the head of its chain, with all
+ * its slices free.
+ */
+int ouichefs_slice_add(struct ouichefs_sb_info *sbi, uint32_t bno,
+		       uint32_t class)
+{
+	struct ouichefs_sliced_block *head;
+	uint32_t *chain = slice_chain(sbi, class);
+	int ret;
+
+	mutex_lock(&sbi->s_slice_lock);
+	ret = sblock_insert(sbi, bno, class,
+			    OUICHEFS_BITMAP_CLASS_ALL_FREE(class), *chain, 0,
+			    true);
+	if (!ret) {
+		head = xa_load(&sbi->s_sliced, *chain);
+		if (head) {
+			sblock_lock(head);
+			head->prev = bno;
+			head->dirty = true;
+			sblock_unlock(head);
+		}
+		*chain = bno;
+	}
+	mutex_unlock(&sbi->s_slice_lock);
+
+	return ret;
+}
+
+/*
+ * Claim nr_slices consecutive free slices in sblock, with its bitmap locked.
+ * Returns the first slice, or 0 if there is no room.
+ */
+static uint32_t sblock_claim(struct ouichefs_sliced_block *sblock,
+			     uint32_t nr_slices)
+{
+	uint32_t slice_no, mask;
+
+	/* Bit 0 is never free, slices are counted from 1 */
+	mask = ((1U << nr_slices) - 1) << 1;
+	for (slice_no = 1; slice_no <= OUICHEFS_BITMAP_SIZE_BITS - nr_slices;
+	     slice_no++, mask <<= 1) {
+		if ((sblock->bitmap & mask) == mask) {
+			sblock->bitmap &= ~mask;
+			sblock->dirty = true;
+			return slice_no;
+		}
+	}
+
+	return 0;
+}
+
+/* Claim slices in sblock wherever it is, with s_slice_lock held */
+static uint32_t sblock_claim_locked(struct ouichefs_sb_info *sbi,
+				    struct ouichefs_sliced_block *sblock,
+				    uint32_t nr_slices)
+{
+	uint32_t slice_no;
+
+	sblock_lock(sblock);
+	slice_no = sblock_claim(sblock, nr_slices);
+	if (slice_no)
+		sblock_changed(sbi, sblock);
+	sblock_unlock(sblock);
+
+	return slice_no;
+}
+
+/* Block of class with the shortest run of at least nr_slices free slices */
+static struct ouichefs_sliced_block *
+sblock_best_fit(struct ouichefs_sb_info *sbi, uint32_t class,
+		uint32_t nr_slices)
+{
+	struct ouichefs_sliced_block *sblock;
+	uint32_t run;
+
+	for (run = nr_slices; run < OUICHEFS_BITMAP_SIZE_BITS; run++) {
+		sblock = list_first_entry_or_null(&sbi->s_sliced_runs[class][run],
+						  struct ouichefs_sliced_block,
+						  list);
+		if (sblock)
+			return sblock;
+	}
+
+	return NULL;
+}
+
+/*
+ * Claim nr_slices consecutive slices in a sliced block of class, preferably
+ * in the sliced block hint. Returns the first slice and sets *bno, or returns
+ * 0 if no sliced block has room.
+ */
+uint32_t ouichefs_slice_alloc(struct ouichefs_sb_info *sbi, uint32_t class,
+			      uint32_t nr_slices, uint32_t hint, uint32_t *bno)
+{
+	struct ouichefs_slice_pool *pool = raw_cpu_ptr(sbi->s_slice_pools);
+	struct ouichefs_sliced_block *sblock, *old;
+	uint32_t slice_no = 0;
+
+	/* Fast path: the current block of this CPU, unless hint is elsewhere */
+	spin_lock(&pool->lock);
+	sblock = pool->cur[class];
+	if (sblock && (!hint || hint == sblock->bno)) {
+		slice_no = sblock_claim(sblock, nr_slices);
+		if (slice_no)
+			*bno = sblock->bno;
+	}
+	spin_unlock(&pool->lock);
+	if (slice_no)
+		return slice_no;
+
+	mutex_lock(&sbi->s_slice_lock);
+	sblock = xa_load(&sbi->s_sliced, hint);
+	if (sblock && sblock->class == class && !sblock->draining) {
+		slice_no = sblock_claim_locked(sbi, sblock, nr_slices);
+		if (slice_no)
+			goto out;
+	}
+
+	/* Refill the pool: its block goes back to the buckets */
+	sblock = sblock_best_fit(sbi, class, nr_slices);
+	if (!sblock)
+		goto out;
+	list_del_init(&sblock->list);
+
+	spin_lock(&pool->lock);
+	old = pool->cur[class];
+	if (old)
+		old->pool = NULL;
+	sblock->pool = pool;
+	pool->cur[class] = sblock;
+	slice_no = sblock_claim(sblock, nr_slices);
+	spin_unlock(&pool->lock);
+
+	if (old)
+		sblock_changed(sbi, old);
+out:
+	if (slice_no)
+		*bno = sblock->bno;
+	mutex_unlock(&sbi->s_slice_lock);
+
+	return slice_no;
+}
+
+/*
+ * Grow the slices of a small file in place, from old_nr to new_nr starting at
+ * slice_no of sliced block bno, if the slices right after them are free.
+ * Returns true if they were claimed.
+ */
+bool ouichefs_slice_grow(struct ouichefs_sb_info *sbi, uint32_t bno,
+			 uint32_t slice_no, uint32_t old_nr, uint32_t new_nr)
+{
+	struct ouichefs_sliced_block *sblock;
+	uint32_t mask;
+	bool grown = false;
+
+	if (slice_no + new_nr > OUICHEFS_BITMAP_SIZE_BITS)
+		return false;
+
+	mask = ((1U << (new_nr - old_nr)) - 1) << (slice_no + old_nr);
+
+	mutex_lock(&sbi->s_slice_lock);
+	sblock = xa_load(&sbi->s_sliced, bno);
+	if (sblock) {
+		sblock_lock(sblock);
+		if ((sblock->bitmap & mask) == mask) {
+			sblock->bitmap &= ~mask;
+			sblock_changed(sbi, sblock);
+			grown = true;
+		}
+		sblock_unlock(sblock);
+	}
+	mutex_unlock(&sbi->s_slice_lock);
+
+	return grown;
+}
+
+/*
+ * Give back nr_slices slices from slice_no of sliced block bno. If the block
+ * is now empty, it is taken from the pool owning it if any, unlinked from its
+ * chain and forgotten, and true is returned: the caller frees it.
+ */
+bool ouichefs_slice_free(struct ouichefs_sb_info *sbi, uint32_t bno,
+			 uint32_t slice_no, uint32_t nr_slices)
+{
+	struct ouichefs_sliced_block *sblock, *prev, *next;
+	struct ouichefs_slice_pool *pool;
+	bool empty = false;
+
+	mutex_lock(&sbi->s_slice_lock);
+	sblock = xa_load(&sbi->s_sliced, bno);
+	if (!sblock) {
+		pr_err("sliced block %u is not in the index\n", bno);
+		goto out;
+	}
+
+	pool = sblock->pool;
+	sblock_lock(sblock);
+	sblock->bitmap |= ((1U << nr_slices) - 1) << slice_no;
+	empty = sblock->bitmap == OUICHEFS_BITMAP_CLASS_ALL_FREE(sblock->class);
+	if (empty && pool) {
+		pool->cur[sblock->class] = NULL;
+		sblock->pool = NULL;
+	} else if (!empty) {
+		sblock_changed(sbi, sblock);
+	}
+	if (pool)
+		spin_unlock(&pool->lock);
+	if (!empty) {
+		if (!sblock->pool && sblock_sparse(sblock) &&
+		    !sbi->s_compact_stopped)
+			queue_delayed_work(system_unbound_wq,
+					   &sbi->s_compact_work,
+					   OUICHEFS_COMPACT_DELAY);
+		goto out;
+	}
+
+	prev = xa_load(&sbi->s_sliced, sblock->prev);
+	next = xa_load(&sbi->s_sliced, sblock->next);
+	if (prev) {
+		sblock_lock(prev);
+		prev->next = sblock->next;
+		prev->dirty = true;
+		sblock_unlock(prev);
+	} else {
+		*slice_chain(sbi, sblock->class) = sblock->next;
+	}
+	if (next) {
+		sblock_lock(next);
+		next->prev = sblock->prev;
+		next->dirty = true;
+		sblock_unlock(next);
+	}
+
+	xa_erase(&sbi->s_sliced, bno);
+	list_del(&sblock->list);
+	kfree(sblock);
+out:
+	mutex_unlock(&sbi->s_slice_lock);
+
+	return empty;
+}
+
+static void sblock_write_header(struct ouichefs_sliced_block *sblock,
+				struct buffer_head *bh)
+{
+	sblock_lock(sblock);
+	OUICHEFS_SLICED_BLOCK_SB_SET_BITMAP(bh, sblock->bitmap);
+	OUICHEFS_SLICED_BLOCK_SB_SET_NEXT(bh, sblock->next);
+	OUICHEFS_SLICED_BLOCK_SB_SET_CLASS(bh, sblock->class);
+	OUICHEFS_SLICED_BLOCK_SB_SET_PREV(bh, sblock->prev);
+	sblock->dirty = false;
+	sblock_unlock(sblock);
+}
+
+/*
+ * Copy the header of sliced block bh from the mirror, before bh is marked
+ * dirty by the caller.
+ */
+void ouichefs_slice_write_header(struct ouichefs_sb_info *sbi,
+				 struct buffer_head *bh)
+{
+	struct ouichefs_sliced_block *sblock;
+
+	mutex_lock(&sbi->s_slice_lock);
+	sblock = xa_load(&sbi->s_sliced, bh->b_blocknr);
+	if (sblock)
+		sblock_write_header(sblock, bh);
+	mutex_unlock(&sbi->s_slice_lock);
+}
+
+/* Write back the headers that changed since their block was last written */
+int ouichefs_sync_slice_headers(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_sliced_block *sblock;
+	struct buffer_head *bh;
+	unsigned long bno;
+	int ret = 0;
+
+	mutex_lock(&sbi->s_slice_lock);
+	xa_for_each(&sbi->s_sliced, bno, sblock) {
+		if (!READ_ONCE(sblock->dirty))
+			continue;
+		bh = sb_bread(sb, bno);
+		if (!bh) {
+			ret = -EIO;
+			continue;
+		}
+		sblock_write_header(sblock, bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+	mutex_unlock(&sbi->s_slice_lock);
+
+	return ret;
+}
+
+/* Number of free slices, of all classes */
+uint32_t ouichefs_slice_free_count(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_sliced_block *sblock;
+	unsigned long bno;
+	uint32_t count = 0;
+
+	mutex_lock(&sbi->s_slice_lock);
+	xa_for_each(&sbi->s_sliced, bno, sblock) {
+		sblock_lock(sblock);
+		count += hweight32(sblock->bitmap);
+		sblock_unlock(sblock);
+	}
+	mutex_unlock(&sbi->s_slice_lock);
+
+	return count;
+}
+
+/*
+ * Compaction moves the files of sparse sliced blocks into the other blocks of
+ * their class, so that the emptied blocks are freed. There is no reverse map
+ * from slices to files: the blocks to empty are marked as draining, which
+ * keeps new files out of them, then every small file is looked at once.
+ */
+
+/*
+ * Mark as draining the sparsest blocks of each class, as long as their used
+ * slices fit in the free slices of the blocks left. The current blocks of the
+ * CPU pools are left alone. Returns the number of draining blocks.
+ */
+static uint32_t compact_start(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_sliced_block *sblock;
+	uint32_t class, used, free, drained_used, drained_free, nr = 0;
+	unsigned long bno;
+
+	mutex_lock(&sbi->s_slice_lock);
+	for (class = 0; class < OUICHEFS_NR_SLICE_CLASSES; class++) {
+		free = 0;
+		xa_for_each(&sbi->s_sliced, bno, sblock) {
+			if (sblock->class == class && !sblock->pool)
+				free += hweight32(sblock->bitmap);
+		}
+
+		drained_used = drained_free = 0;
+		for (used = 1; used * 2 <= OUICHEFS_SLICE_CLASS_NR(class);
+		     used++) {
+			xa_for_each(&sbi->s_sliced, bno, sblock) {
+				if (sblock->class != class || sblock->draining ||
+				    sblock->pool || sblock_used(sblock) != used)
+					continue;
+				if (drained_used + used >
+				    free - drained_free - hweight32(sblock->bitmap))
+					goto next_class;
+				drained_used += used;
+				drained_free += hweight32(sblock->bitmap);
+				sblock->draining = true;
+				list_del_init(&sblock->list);
+				nr++;
+			}
+		}
+next_class:;
+	}
+	mutex_unlock(&sbi->s_slice_lock);
+
+	return nr;
+}
+
+/* Put the blocks that could not be emptied back in their buckets */
+static void compact_end(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_sliced_block *sblock;
+	unsigned long bno;
+
+	mutex_lock(&sbi->s_slice_lock);
+	xa_for_each(&sbi->s_sliced, bno, sblock) {
+		if (!sblock->draining)
+			continue;
+		sblock->draining = false;
+		list_move(&sblock->list,
+			  &sbi->s_sliced_runs[sblock->class][sblock->run]);
+	}
+	mutex_unlock(&sbi->s_slice_lock);
+}
+
+static bool compact_draining(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	struct ouichefs_sliced_block *sblock;
+	bool draining;
+
+	mutex_lock(&sbi->s_slice_lock);
+	sblock = xa_load(&sbi->s_sliced, bno);
+	draining = sblock && sblock->draining;
+	mutex_unlock(&sbi->s_slice_lock);
+
+	return draining;
+}
+
+/* Offset of slice slice_no (counted from 1) in a sliced block of class */
+static size_t slice_offset(uint32_t class, uint32_t slice_no)
+{
+	return OUICHEFS_SLICE_SIZE +
+	       (slice_no - 1) * OUICHEFS_SLICE_CLASS_SIZE(class);
+}
+
+/* Move the slices of inode out of its sliced block if it is draining */
+static int compact_file(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh_old = NULL, *bh_new;
+	uint32_t old_bno, old_slice, bno, slice_no, class, nr;
+	size_t len;
+	int ret = 0;
+
+	/* Keep readers of the page cache away while the slice moves */
+	inode_lock(inode);
+	filemap_invalidate_lock(inode->i_mapping);
+	if (inode->i_blocks || !ci->index_block || !ci->num_slices)
+		goto unlock;
+	old_bno = OUICHEFS_SMALL_FILE_GET_BNO(ci);
+	old_slice = OUICHEFS_SMALL_FILE_GET_SLICE(ci);
+	if (!compact_draining(sbi, old_bno))
+		goto unlock;
+
+	/* Data written through mmap goes to the slice first */
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		goto unlock;
+
+	bh_old = sb_bread(sb, old_bno);
+	if (!bh_old) {
+		ret = -EIO;
+		goto unlock;
+	}
+	class = OUICHEFS_SLICED_BLOCK_SB_CLASS(bh_old);
+	nr = ci->num_slices;
+	len = nr * OUICHEFS_SLICE_CLASS_SIZE(class);
+
+	/* No room left in the other blocks, the file stays where it is */
+	slice_no = ouichefs_slice_alloc(sbi, class, nr, 0, &bno);
+	if (!slice_no)
+		goto unlock;
+
+	bh_new = sb_bread(sb, bno);
+	if (!bh_new) {
+		ouichefs_slice_free(sbi, bno, slice_no, nr);
+		ret = -EIO;
+		goto unlock;
+	}
+	memcpy(bh_new->b_data + slice_offset(class, slice_no),
+	       bh_old->b_data + slice_offset(class, old_slice), len);
+	ouichefs_slice_write_header(sbi, bh_new);
+	mark_buffer_dirty(bh_new);
+	sync_dirty_buffer(bh_new);
+	brelse(bh_new);
+
+	WRITE_ONCE(ci->index_block, (bno << 5) + slice_no);
+	mark_inode_dirty(inode);
+	/* The folios are clean, they are read again from the new slice */
+	invalidate_inode_pages2(inode->i_mapping);
+
+	memset(bh_old->b_data + slice_offset(class, old_slice), 0, len);
+	if (ouichefs_slice_free(sbi, old_bno, old_slice, nr)) {
+		pr_debug("sliced block %u emptied, freeing it\n", old_bno);
+		sbi->nr_sliced_blocks--;
+		/* The block may be reused for file data, drop the buffer */
+		bforget(bh_old);
+		bh_old = NULL;
+		put_block(sbi, old_bno);
+	} else {
+		ouichefs_slice_write_header(sbi, bh_old);
+		mark_buffer_dirty(bh_old);
+	}
+
+unlock:
+	brelse(bh_old);
+	filemap_invalidate_unlock(inode->i_mapping);
+	inode_unlock(inode);
+
+	return ret;
+}
+
+static void compact_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi = container_of(
+		to_delayed_work(work), struct ouichefs_sb_info, s_compact_work);
+	struct super_block *sb = sbi->s_sb;
+	struct inode *inode;
+	uint32_t ino, nr_draining;
+
+	nr_draining = compact_start(sbi);
+	if (!nr_draining)
+		return;
+
+	for (ino = 1; ino < sbi->nr_inodes; ino++) {
+		if (test_bit(ino, sbi->ifree_bitmap))
+			continue;
+		inode = ouichefs_iget(sb, ino);
+		if (IS_ERR(inode))
+			continue;
+		if (S_ISREG(inode->i_mode) && inode->i_nlink &&
+		    compact_file(inode))
+			pr_err("cannot move the slices of inode %u\n", ino);
+		iput(inode);
+		cond_resched();
+	}
+
+	compact_end(sbi);
+	pr_debug("compacted %u sparse sliced blocks\n", nr_draining);
+}
+
+/* Compact the sliced blocks now and wait for it to be done */
+void ouichefs_compact_slices(struct ouichefs_sb_info *sbi)
+{
+	mutex_lock(&sbi->s_slice_lock);
+	if (sbi->s_compact_stopped) {
+		mutex_unlock(&sbi->s_slice_lock);
+		return;
+	}
+	mod_delayed_work(system_unbound_wq, &sbi->s_compact_work, 0);
+	mutex_unlock(&sbi->s_slice_lock);
+
+	flush_delayed_work(&sbi->s_compact_work);
+}
+
+/* Called at unmount, before the inodes are evicted */
+void ouichefs_stop_compaction(struct ouichefs_sb_info *sbi)
+{
+	mutex_lock(&sbi->s_slice_lock);
+	sbi->s_compact_stopped = true;
+	mutex_unlock(&sbi->s_slice_lock);
+
+	cancel_delayed_work_sync(&sbi->s_compact_work);
+}
+
+void ouichefs_destroy_slice_index(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_sliced_block *sblock;
+	unsigned long bno;
+
+	xa_for_each(&sbi->s_sliced, bno, sblock)
+		kfree(sblock);
+	xa_destroy(&sbi->s_sliced);
+	free_percpu(sbi->s_slice_pools);
+	sbi->s_slice_pools = NULL;
+}
+
+/*
+ * Build the mirror from the sliced block chains of every class. Chains written
+ * before back pointers existed have none, they are rebuilt on the way.
+ */
+int ouichefs_init_slice_index(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	uint32_t class, run, bno, prev, next;
+	int cpu, ret;
+
+	mutex_init(&sbi->s_slice_lock);
+	xa_init(&sbi->s_sliced);
+	INIT_DELAYED_WORK(&sbi->s_compact_work, compact_work);
+	sbi->s_compact_stopped = false;
+
+	/* Pools start without a block, they take one on first use */
+	sbi->s_slice_pools = alloc_percpu(struct ouichefs_slice_pool);
+	if (!sbi->s_slice_pools)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(sbi->s_slice_pools, cpu)->lock);
+	for (class = 0; class < OUICHEFS_NR_SLICE_CLASSES; class++)
+		for (run = 0; run < OUICHEFS_BITMAP_SIZE_BITS; run++)
+			INIT_LIST_HEAD(&sbi->s_sliced_runs[class][run]);
+
+	for (class = 0; class < OUICHEFS_NR_SLICE_CLASSES; class++) {
+		bno = *slice_chain(sbi, class);
+		prev = 0;
+		while (bno) {
+			bh = sb_bread(sb, bno);
+			if (!bh) {
+				ret = -EIO;
+				goto err;
+			}
+			next = OUICHEFS_SLICED_BLOCK_SB_NEXT(bh);
+			ret = sblock_insert(
+				sbi, bno, class,
+				OUICHEFS_SLICED_BLOCK_SB_BITMAP(bh), next, prev,
+				OUICHEFS_SLICED_BLOCK_SB_PREV(bh) != prev);
+			brelse(bh);
+			if (ret)
+				goto err;
+			prev = bno;
+			bno = next;
+		}
+	}
+
+	return 0;
+
+err:
+	ouichefs_destroy_slice_index(sbi);
+	return ret;
+}
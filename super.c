@@ -42,6 +42,14 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	if (!ci)
 		return NULL;
 	inode_init_once(&ci->vfs_inode);
+	ci->block_map = NULL;
+	ci->ind_map = NULL;
+	ci->dind_map = NULL;
+	mutex_init(&ci->block_map_lock);
+	xa_init(&ci->i_delalloc);
+	ci->i_delalloc_ind = 0;
+	ci->i_meta_reserved = 0;
+	memset(ci->i_slice_hint, 0, sizeof(ci->i_slice_hint));
 	return &ci->vfs_inode;
 }
 
@@ -53,6 +61,20 @@ static void ouichefs_destroy_inode(struct inode *inode)
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
+/*
+ * Called when the last reference to an inode is dropped. Besides the page
+ * cache, drop the in-memory block map and the index block buffer that
+ * ouichefs_map_blocks() attached to the inode for fsync().
+ */
+static void ouichefs_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages_final(&inode->i_data);
+	invalidate_inode_buffers(inode);
+	ouichefs_release_delalloc(inode, 0, U32_MAX);
+	ouichefs_drop_block_map(inode);
+	clear_inode(inode);
+}
+
 static int ouichefs_write_inode(struct inode *inode,
 				struct writeback_control *wbc)
 {
@@ -64,6 +86,7 @@ static int ouichefs_write_inode(struct inode *inode,
 	uint32_t ino = inode->i_ino;
 	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
 	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	int i;
 
 	if (ino >= sbi->nr_inodes)
 		return 0;
@@ -89,9 +112,16 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode->i_nlink = cpu_to_le32(inode->i_nlink);
 	disk_inode->index_block = cpu_to_le32(ci->index_block);
 	disk_inode->num_slices = cpu_to_le16(ci->num_slices);
+	if (ouichefs_is_inline(inode))
+		memcpy(disk_inode->i_data, ci->i_data, OUICHEFS_INLINE_DATA_SIZE);
+	else
+		for (i = 0; i < OUICHEFS_NR_DIRECT_BLOCKS; i++)
+			disk_inode->i_direct[i] =
+				cpu_to_le32(ci->i_direct[i]);
 
 	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		sync_dirty_buffer(bh);
 	brelse(bh);
 
 	return 0;
@@ -102,6 +132,7 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_sb_info *disk_sb;
 	struct buffer_head *bh;
+	int i;
 
 	pr_info("sbi->s_free_sliced_blocks: %u\n", sbi->s_free_sliced_blocks);
 
@@ -119,8 +150,12 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	disk_sb->nr_free_inodes = cpu_to_le32(sbi->nr_free_inodes);
 	disk_sb->nr_free_blocks = cpu_to_le32(sbi->nr_free_blocks);
 	disk_sb->s_free_sliced_blocks = cpu_to_le32(sbi->s_free_sliced_blocks);
+	for (i = 0; i < OUICHEFS_NR_SLICE_CLASSES - 1; i++)
+		disk_sb->s_free_sliced_classes[i] =
+			cpu_to_le32(sbi->s_free_sliced_classes[i]);
 	disk_sb->nr_used_slices = cpu_to_le32(sbi->nr_used_slices);
 	disk_sb->nr_sliced_blocks = cpu_to_le32(sbi->nr_sliced_blocks);
+	disk_sb->s_features = cpu_to_le32(sbi->s_features);
 
 	mark_buffer_dirty(bh);
 	if (wait)
@@ -190,6 +225,7 @@ static void ouichefs_put_super(struct super_block *sb)
 
 	if (sbi) {
 		ouichefs_unregister_sysfs(sb);
+		ouichefs_destroy_slice_index(sbi);
 		kfree(sbi->ifree_bitmap);
 		kfree(sbi->bfree_bitmap);
 		kfree(sbi);
@@ -200,6 +236,9 @@ static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
 	int ret = 0;
 
+	ret = ouichefs_sync_slice_headers(sb);
+	if (ret)
+		return ret;
 	ret = sync_sb_info(sb, wait);
 	if (ret)
 		return ret;
@@ -217,12 +256,17 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 {
 	struct super_block *sb = dentry->d_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t nr_free = 0;
+
+	/* Blocks reserved by delayed allocation are as good as used */
+	if (sbi->nr_free_blocks > sbi->s_reserved_blocks)
+		nr_free = sbi->nr_free_blocks - sbi->s_reserved_blocks;
 
 	stat->f_type = OUICHEFS_MAGIC;
 	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
 	stat->f_blocks = sbi->nr_blocks;
-	stat->f_bfree = sbi->nr_free_blocks;
-	stat->f_bavail = sbi->nr_free_blocks;
+	stat->f_bfree = nr_free;
+	stat->f_bavail = nr_free;
 	stat->f_files = sbi->nr_inodes;
 	stat->f_ffree = sbi->nr_free_inodes;
 	stat->f_namelen = OUICHEFS_FILENAME_LEN;
@@ -235,6 +279,7 @@ static struct super_operations ouichefs_super_ops = {
 	.alloc_inode = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
 	.write_inode = ouichefs_write_inode,
+	.evict_inode = ouichefs_evict_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
 };
@@ -246,6 +291,7 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	struct ouichefs_sb_info *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
+	uint32_t features;
 	int ret = 0, i;
 
 	/* Init sb */
@@ -273,6 +319,16 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		return -EPERM;
 	}
 
+	/* Older images have 80-byte inodes, their inode store reads as garbage */
+	features = le32_to_cpu(csb->s_features);
+	if (!(features & OUICHEFS_FEATURE_INODE128) ||
+	    (features & ~OUICHEFS_FEATURES_KNOWN)) {
+		pr_err("Unsupported features %#x, reformat with the current mkfs.ouichefs\n",
+		       features);
+		brelse(bh);
+		return -EINVAL;
+	}
+
 	/* Alloc sb_info */
 	sbi = kzalloc(sizeof(struct ouichefs_sb_info), GFP_KERNEL);
 	if (!sbi) {
@@ -290,9 +346,15 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_free_inodes = le32_to_cpu(csb->nr_free_inodes);
 	sbi->nr_free_blocks = le32_to_cpu(csb->nr_free_blocks);
 	sbi->s_free_sliced_blocks = le32_to_cpu(csb->s_free_sliced_blocks);
+	for (i = 0; i < OUICHEFS_NR_SLICE_CLASSES - 1; i++)
+		sbi->s_free_sliced_classes[i] =
+			le32_to_cpu(csb->s_free_sliced_classes[i]);
 	sbi->nr_used_slices = le32_to_cpu(csb->nr_used_slices);
 	sbi->nr_sliced_blocks = le32_to_cpu(csb->nr_sliced_blocks);
+	sbi->s_features = features;
 	
+	spin_lock_init(&sbi->s_alloc_lock);
+
 	sbi->s_sb = sb;
 	sb->s_fs_info = sbi;
 	
@@ -346,6 +408,10 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		brelse(bh);
 	}
 
+	ret = ouichefs_init_slice_index(sb);
+	if (ret)
+		goto free_bfree;
+
 	/* 
 	 * Create root inode.
 	 *
@@ -359,14 +425,14 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	root_inode = ouichefs_iget(sb, 1);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto free_slices;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
 	/* d_make_root should only be run once */
 	sb->s_root = d_make_root(root_inode);
 	if (!sb->s_root) {
 		ret = -ENOMEM;
-		goto free_bfree;
+		goto free_slices;
 	}
 
 	ret = ouichefs_register_sysfs(sb);
@@ -378,6 +444,9 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 
 free_root:
 	dput(sb->s_root);
+	sb->s_root = NULL;
+free_slices:
+	ouichefs_destroy_slice_index(sbi);
 free_bfree:
 	kfree(sbi->bfree_bitmap);
 free_ifree:
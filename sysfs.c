@@ -130,16 +130,11 @@ static ssize_t total_free_slices_show(struct kobject *kobj,
 				      struct kobj_attribute *attr, char *buf)
 {
 	struct ouichefs_sb_info *sbi = SBI_FROM_KOBJ(kobj);
-	if (sbi->s_free_sliced_blocks == 0)
-		return snprintf(buf, PAGE_SIZE, "0");
 
 	pr_info("%s: sbi->nr_sliced_blocks: %u, sbi->nr_used_slices: %u\n",
 		__func__, sbi->nr_sliced_blocks, sbi->nr_used_slices);
 
-	return snprintf(buf, PAGE_SIZE, "%u",
-			sbi->nr_sliced_blocks *
-					OUICHEFS_SLICES_PER_SLICED_BLOCK -
-				sbi->nr_used_slices);
+	return snprintf(buf, PAGE_SIZE, "%u", ouichefs_slice_free_count(sbi));
 }
 
 static ssize_t files_show(struct kobject *kobj, struct kobj_attribute *attr,
@@ -178,6 +173,19 @@ static ssize_t efficiency_show(struct kobject *kobj,
 			((total_data_size(sbi) * 100) / total_used_size(sbi)));
 }
 
+/* Writing anything compacts the sliced blocks, and returns once it is done */
+static ssize_t compact_store(struct kobject *kobj, struct kobj_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct ouichefs_sb_info *sbi = SBI_FROM_KOBJ(kobj);
+
+	ouichefs_compact_slices(sbi);
+	return count;
+}
+
+static struct kobj_attribute compact_attribute =
+	__ATTR(compact, 0200, NULL, compact_store);
+
 OUICHEFS_ATTR(free_blocks);
 OUICHEFS_ATTR(used_blocks);
 OUICHEFS_ATTR(sliced_blocks);
@@ -193,7 +201,8 @@ static struct attribute *ouichefs_attrs[] = {
 	&sliced_blocks_attribute.attr,	 &total_free_slices_attribute.attr,
 	&files_attribute.attr,		 &small_files_attribute.attr,
 	&total_data_size_attribute.attr, &total_used_size_attribute.attr,
-	&efficiency_attribute.attr,	 NULL,
+	&efficiency_attribute.attr,	 &compact_attribute.attr,
+	NULL,
 };
 
 ATTRIBUTE_GROUPS(ouichefs);
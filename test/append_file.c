@@ -1,4 +1,9 @@
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "util.h"
 #include "error.h"
 #include "tests.h"
@@ -230,3 +235,59 @@ int append_big_to_big_file(void)
 
 	return 0;
 }
+
+#define A_LARGE_NAME "alarge.txt"
+#define A_LARGE_SIZE (1024 * 1024)
+
+/* A single large append converts a small file to a big one */
+int append_large_to_small_file(void)
+{
+	char *buf, rbuf[4096];
+	struct stat st;
+	off_t off;
+	int ret = 0;
+
+	buf = malloc(A_LARGE_SIZE);
+	if (!buf)
+		return ERR_WRITE;
+	memset(buf, 'b', A_LARGE_SIZE);
+
+	int fd = open(OUICHEFS_FILE_NAME(A_LARGE_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR | O_APPEND, 0644);
+	if (fd < 0) {
+		ret = ERR_CREATE;
+		goto out;
+	}
+
+	if (write(fd, PAYLOAD100, 100) != 100 ||
+	    write(fd, buf, A_LARGE_SIZE) != A_LARGE_SIZE) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	if (fstat(fd, &st) || st.st_size != 100 + A_LARGE_SIZE) {
+		ret = ERR_CMP;
+		goto close;
+	}
+
+	for (off = 0; off < st.st_size; off += sizeof(rbuf)) {
+		ssize_t n = pread(fd, rbuf, sizeof(rbuf), off);
+		if (n <= 0) {
+			ret = ERR_READ;
+			goto close;
+		}
+		for (ssize_t i = 0; i < n; i++) {
+			if (rbuf[i] != (off + i < 100 ? 'a' : 'b')) {
+				ret = ERR_CMP;
+				goto close;
+			}
+		}
+	}
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+out:
+	free(buf);
+	return ret;
+}
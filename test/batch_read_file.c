@@ -0,0 +1,108 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../ioctl.h"
+#include "tests.h"
+#include "util.h"
+#include "error.h"
+
+#define B_DIR OUICHEFS_FILE_NAME("batch")
+#define B_FILES 12
+
+static char *const payloads[] = { "", PAYLOAD10, PAYLOAD100, PAYLOAD1000 };
+#define B_NR_PAYLOADS (sizeof(payloads) / sizeof(payloads[0]))
+
+static int write_file(const char *name, const char *payload)
+{
+	size_t len = strlen(payload);
+	FILE *file;
+	int ret = 0;
+
+	remove(name);
+	file = fopen(name, "w");
+	if (!file)
+		return ERR_CREATE;
+	if (fwrite(payload, 1, len, file) != len)
+		ret = ERR_WRITE;
+	if (fclose(file) && !ret)
+		ret = ERR_CLOSE;
+
+	return ret;
+}
+
+/*
+ * Small files read with one call on their directory, by name and by inode
+ * number, plus a missing file, then a file that does not fit in the buffer.
+ */
+int batch_read_small_files(void)
+{
+	struct ouichefs_read_file files[B_FILES + 1];
+	struct ouichefs_read_batch_ioctl arg;
+	static char buf[B_FILES * 1000];
+	char name[64];
+	struct stat st;
+	char *payload;
+	int ret, fd, i;
+
+	if (mkdir(B_DIR, 0755) && errno != EEXIST)
+		return ERR_CREATE;
+
+	memset(files, 0, sizeof(files));
+	for (i = 0; i < B_FILES; i++) {
+		snprintf(files[i].name, sizeof(files[i].name), "b_%d.txt", i);
+		snprintf(name, sizeof(name), B_DIR "/%s", files[i].name);
+		ret = write_file(name, payloads[i % B_NR_PAYLOADS]);
+		if (ret)
+			return ret;
+		/* Every other file by inode number */
+		if (i % 2) {
+			if (stat(name, &st))
+				return ERR_OPEN;
+			files[i].ino = st.st_ino;
+		}
+	}
+	snprintf(files[B_FILES].name, sizeof(files[B_FILES].name), "missing");
+
+	fd = open(B_DIR, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return ERR_OPEN;
+
+	arg.nr_files = B_FILES + 1;
+	arg.buf_size = sizeof(buf);
+	arg.files = files;
+	arg.buf = buf;
+	ret = ioctl(fd, OUICHEFS_READ_BATCH_IOCTL, &arg);
+	if (ret != B_FILES) {
+		ret = ERR_READ;
+		goto close;
+	}
+
+	ret = 0;
+	for (i = 0; i < B_FILES && !ret; i++) {
+		payload = payloads[i % B_NR_PAYLOADS];
+		if (files[i].size != (int)strlen(payload) ||
+		    memcmp(buf + files[i].offset, payload, files[i].size))
+			ret = ERR_CMP;
+	}
+	if (!ret && files[B_FILES].size != -ENOENT)
+		ret = ERR_CMP;
+	if (ret)
+		goto close;
+
+	/* b_1.txt holds 10 bytes */
+	arg.nr_files = 1;
+	arg.buf_size = 5;
+	arg.files = &files[1];
+	if (ioctl(fd, OUICHEFS_READ_BATCH_IOCTL, &arg) != 0 ||
+	    files[1].size != -ENOSPC)
+		ret = ERR_CMP;
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
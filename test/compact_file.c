@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+#include "util.h"
+#include "error.h"
+
+#define C_DIR OUICHEFS_FILE_NAME("compact")
+#define C_FILES (3 * 31)
+#define C_KEEP 9 /* Keep one file out of C_KEEP */
+
+/*
+ * Spread a few small files over several sliced blocks, then check that
+ * compaction frees some of the blocks without changing the files.
+ */
+int compact_sparse_slices(void)
+{
+	unsigned int before, after;
+	char name[64];
+	FILE *file;
+	int ret, i;
+
+	ret = make_test_dir(C_DIR);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < C_FILES; i++) {
+		snprintf(name, sizeof(name), C_DIR "/%d.txt", i);
+		file = fopen(name, "w");
+		if (!file) {
+			ret = ERR_CREATE;
+			goto out;
+		}
+		if (fputs(PAYLOAD100, file) < 0)
+			ret = ERR_WRITE;
+		if (fclose(file) && !ret)
+			ret = ERR_CLOSE;
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < C_FILES; i++) {
+		if (i % C_KEEP == 0)
+			continue;
+		snprintf(name, sizeof(name), C_DIR "/%d.txt", i);
+		if (remove(name)) {
+			ret = ERR_REMOVE;
+			goto out;
+		}
+	}
+
+	ret = read_sysfs_uint("sliced_blocks", &before);
+	if (!ret)
+		ret = write_sysfs("compact", "1");
+	if (!ret)
+		ret = read_sysfs_uint("sliced_blocks", &after);
+	if (ret)
+		goto out;
+	if (after >= before) {
+		ret = ERR_CMP;
+		goto out;
+	}
+
+	for (i = 0; i < C_FILES && !ret; i += C_KEEP) {
+		snprintf(name, sizeof(name), C_DIR "/%d.txt", i);
+		file = fopen(name, "r");
+		if (!file) {
+			ret = ERR_OPEN;
+			break;
+		}
+		ret = read_and_cmp_content(file, PAYLOAD100);
+		fclose(file);
+	}
+
+out:
+	if (remove_test_dir(C_DIR) && !ret)
+		ret = ERR_REMOVE;
+	return ret;
+}
@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tests.h"
+#include "util.h"
+#include "error.h"
+
+#define D_BIG_NAME "dbig.txt"
+#define D_BIG_SIZE (16 * 4096)
+
+int direct_io_big_file(void)
+{
+	int ret = 0;
+	char *wbuf, *rbuf;
+
+	if (posix_memalign((void **)&wbuf, 4096, D_BIG_SIZE))
+		return ERR_WRITE;
+	if (posix_memalign((void **)&rbuf, 4096, D_BIG_SIZE)) {
+		free(wbuf);
+		return ERR_READ;
+	}
+	memset(wbuf, 'a', D_BIG_SIZE);
+	memset(rbuf, 0, D_BIG_SIZE);
+
+	int fd = open(OUICHEFS_FILE_NAME(D_BIG_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR | O_DIRECT, 0644);
+	if (fd < 0) {
+		ret = ERR_CREATE;
+		goto out;
+	}
+
+	if (write(fd, wbuf, D_BIG_SIZE) != D_BIG_SIZE) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	if (pread(fd, rbuf, D_BIG_SIZE, 0) != D_BIG_SIZE) {
+		ret = ERR_READ;
+		goto close;
+	}
+
+	if (memcmp(wbuf, rbuf, D_BIG_SIZE))
+		ret = ERR_CMP;
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+out:
+	free(wbuf);
+	free(rbuf);
+	return ret;
+}
+
+#define D_SMALL_NAME "dsmall.txt"
+
+int direct_io_small_file(void)
+{
+	int ret;
+	FILE *file = fopen(OUICHEFS_FILE_NAME(D_SMALL_NAME), "w");
+	if (!file)
+		return ERR_CREATE;
+
+	ret = fprintf(file, PAYLOAD100);
+	if (ret != 100) {
+		fprintf(stderr, "%s: fprintf returned %d", __func__, ret);
+		return ERR_WRITE;
+	}
+
+	ret = fclose(file);
+	if (ret)
+		return ERR_CLOSE;
+
+	/* Unaligned O_DIRECT on a sliced file falls back to buffered I/O */
+	int fd = open(OUICHEFS_FILE_NAME(D_SMALL_NAME), O_RDONLY | O_DIRECT);
+	if (fd < 0)
+		return ERR_OPEN;
+
+	file = fdopen(fd, "r");
+	if (!file)
+		return ERR_OPEN;
+
+	ret = read_and_cmp_content(file, PAYLOAD100);
+	if (ret)
+		return ret;
+
+	ret = fclose(file);
+	if (ret)
+		return ERR_CLOSE;
+
+	return 0;
+}
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tests.h"
+#include "util.h"
+#include "error.h"
+
+#define F_BIG_NAME "fbig.txt"
+#define F_PUNCH_NAME "fpunch.txt"
+#define F_SIZE (16 * 4096)
+
+static int check_range(int fd, off_t off, size_t len, char c)
+{
+	char buf[4096];
+	size_t i, n;
+
+	while (len) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		if (pread(fd, buf, n, off) != (ssize_t)n)
+			return ERR_READ;
+		for (i = 0; i < n; i++) {
+			if (buf[i] != c)
+				return ERR_CMP;
+		}
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int falloc_big_file(void)
+{
+	struct stat st;
+	int ret;
+
+	int fd = open(OUICHEFS_FILE_NAME(F_BIG_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return ERR_CREATE;
+
+	if (fallocate(fd, 0, 0, F_SIZE)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	if (fstat(fd, &st) || st.st_size != F_SIZE) {
+		ret = ERR_CMP;
+		goto close;
+	}
+
+	/* Preallocated blocks read as zeroes until written */
+	ret = check_range(fd, 0, F_SIZE, 0);
+	if (ret)
+		goto close;
+
+	if (pwrite(fd, PAYLOAD100, 100, 5000) != 100) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	if (fsync(fd)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	ret = check_range(fd, 0, 5000, 0);
+	if (!ret)
+		ret = check_range(fd, 5000, 100, 'a');
+	if (!ret)
+		ret = check_range(fd, 5100, F_SIZE - 5100, 0);
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
+
+int punch_hole_big_file(void)
+{
+	char buf[F_SIZE];
+	struct stat st;
+	int ret;
+
+	int fd = open(OUICHEFS_FILE_NAME(F_PUNCH_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return ERR_CREATE;
+
+	memset(buf, 'a', F_SIZE);
+	if (write(fd, buf, F_SIZE) != F_SIZE || fsync(fd)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	/* Two whole blocks and part of a third */
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 4096,
+		      2 * 4096 + 100)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	if (fstat(fd, &st) || st.st_size != F_SIZE) {
+		ret = ERR_CMP;
+		goto close;
+	}
+
+	ret = check_range(fd, 0, 4096, 'a');
+	if (!ret)
+		ret = check_range(fd, 4096, 2 * 4096 + 100, 0);
+	if (!ret)
+		ret = check_range(fd, 3 * 4096 + 100, F_SIZE - 3 * 4096 - 100,
+				  'a');
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
@@ -0,0 +1,69 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../ioctl.h"
+#include "tests.h"
+#include "util.h"
+#include "error.h"
+
+#define I_DIR OUICHEFS_FILE_NAME("ingest")
+#define I_FILES 20
+
+static char *const payloads[] = { "", PAYLOAD10, PAYLOAD100, PAYLOAD1000,
+				   PAYLOAD3000 };
+#define I_NR_PAYLOADS (sizeof(payloads) / sizeof(payloads[0]))
+
+/* Files of mixed sizes created in one call on their directory */
+int ingest_small_files(void)
+{
+	struct ouichefs_ingest_file files[I_FILES];
+	struct ouichefs_ingest_ioctl arg;
+	char name[64];
+	char *payload;
+	FILE *file;
+	int ret, fd, i;
+
+	if (mkdir(I_DIR, 0755) && errno != EEXIST)
+		return ERR_CREATE;
+
+	memset(files, 0, sizeof(files));
+	for (i = 0; i < I_FILES; i++) {
+		payload = payloads[i % I_NR_PAYLOADS];
+		snprintf(files[i].name, sizeof(files[i].name), "i_%d.txt", i);
+		files[i].mode = 0644;
+		files[i].size = strlen(payload);
+		files[i].data = payload;
+
+		snprintf(name, sizeof(name), I_DIR "/%s", files[i].name);
+		remove(name);
+	}
+
+	fd = open(I_DIR, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return ERR_OPEN;
+
+	arg.nr_files = I_FILES;
+	arg.nr_created = 0;
+	arg.files = files;
+	ret = ioctl(fd, OUICHEFS_INGEST_IOCTL, &arg);
+	close(fd);
+	if (ret != I_FILES || arg.nr_created != I_FILES)
+		return ERR_CREATE;
+
+	for (i = 0; i < I_FILES; i++) {
+		snprintf(name, sizeof(name), I_DIR "/%s", files[i].name);
+		file = fopen(name, "r");
+		if (!file)
+			return ERR_OPEN;
+		ret = read_and_cmp_content(file, payloads[i % I_NR_PAYLOADS]);
+		fclose(file);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
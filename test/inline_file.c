@@ -0,0 +1,91 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tests.h"
+#include "util.h"
+#include "error.h"
+
+#define I_GROW_NAME "igrow.txt"
+#define I_GAP_NAME "igap.txt"
+
+/* Check that the file is exactly the size bytes of expected */
+static int check_content(int fd, const char *expected, size_t size)
+{
+	char buf[4096];
+	struct stat st;
+
+	if (fstat(fd, &st) || st.st_size != (off_t)size)
+		return ERR_CMP;
+	if (pread(fd, buf, sizeof(buf), 0) != (ssize_t)size)
+		return ERR_READ;
+	if (memcmp(buf, expected, size))
+		return ERR_CMP;
+
+	return 0;
+}
+
+int inline_grow_file(void)
+{
+	int ret;
+
+	int fd = open(OUICHEFS_FILE_NAME(I_GROW_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return ERR_CREATE;
+
+	/* Both writes fit in the inode */
+	if (pwrite(fd, PAYLOAD20, 20, 0) != 20 ||
+	    pwrite(fd, PAYLOAD20, 20, 20) != 20) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	ret = check_content(fd, PAYLOAD20 PAYLOAD20, 40);
+	if (ret)
+		goto close;
+
+	/* This one moves the data to a slice */
+	if (pwrite(fd, PAYLOAD100, 100, 40) != 100) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	ret = check_content(fd, PAYLOAD20 PAYLOAD20 PAYLOAD100, 140);
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
+
+int inline_gap_file(void)
+{
+	char expected[40] = { 0 };
+	int ret;
+
+	int fd = open(OUICHEFS_FILE_NAME(I_GAP_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return ERR_CREATE;
+
+	if (pwrite(fd, PAYLOAD10, 10, 30) != 10) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	memset(expected + 30, 'a', 10);
+	ret = check_content(fd, expected, 40);
+	if (ret)
+		goto close;
+
+	/* Shrinking keeps the file inline, growing back reads zeroes */
+	if (ftruncate(fd, 35) || ftruncate(fd, 40)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	memset(expected + 35, 0, 5);
+	ret = check_content(fd, expected, 40);
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
@@ -0,0 +1,71 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "tests.h"
+#include "util.h"
+#include "error.h"
+
+#define M_SMALL_NAME "msmall.txt"
+
+int mmap_small_file(void)
+{
+	int ret;
+	char *map;
+	FILE *file = fopen(OUICHEFS_FILE_NAME(M_SMALL_NAME), "w");
+	if (!file)
+		return ERR_CREATE;
+
+	ret = fprintf(file, PAYLOAD100);
+	if (ret != 100) {
+		fprintf(stderr, "%s: fprintf returned %d", __func__, ret);
+		return ERR_WRITE;
+	}
+
+	ret = fclose(file);
+	if (ret)
+		return ERR_CLOSE;
+
+	int fd = open(OUICHEFS_FILE_NAME(M_SMALL_NAME), O_RDWR);
+	if (fd < 0)
+		return ERR_OPEN;
+
+	map = mmap(NULL, 100, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return ERR_READ;
+	}
+
+	if (memcmp(map, PAYLOAD100, 100)) {
+		munmap(map, 100);
+		close(fd);
+		return ERR_CMP;
+	}
+
+	/* Written back into the slice */
+	memset(map, 'b', 50);
+	ret = msync(map, 100, MS_SYNC);
+	munmap(map, 100);
+	if (ret) {
+		close(fd);
+		return ERR_WRITE;
+	}
+
+	ret = close(fd);
+	if (ret)
+		return ERR_CLOSE;
+
+	file = fopen(OUICHEFS_FILE_NAME(M_SMALL_NAME), "r");
+	if (!file)
+		return ERR_OPEN;
+
+	ret = read_and_cmp_content(file, "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb" PAYLOAD50);
+	if (ret)
+		return ret;
+
+	ret = fclose(file);
+	if (ret)
+		return ERR_CLOSE;
+
+	return 0;
+}
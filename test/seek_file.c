@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "tests.h"
+#include "util.h"
+#include "error.h"
+
+#define S_BIG_NAME "sbig.txt"
+#define S_SMALL_NAME "ssmall.txt"
+#define S_HOLE_START 4096
+#define S_HOLE_END (16 * 4096)
+
+int seek_hole_big_file(void)
+{
+	char buf[4096];
+	int ret = 0;
+
+	int fd = open(OUICHEFS_FILE_NAME(S_BIG_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return ERR_CREATE;
+
+	/* Data, a hole, then data again */
+	memset(buf, 'a', sizeof(buf));
+	if (pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf) ||
+	    pwrite(fd, buf, sizeof(buf), S_HOLE_END) != sizeof(buf)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	/* Once before writeback, once after */
+	for (int i = 0; i < 2 && !ret; i++) {
+		if (lseek(fd, 0, SEEK_HOLE) != S_HOLE_START ||
+		    lseek(fd, S_HOLE_START, SEEK_DATA) != S_HOLE_END ||
+		    lseek(fd, S_HOLE_END, SEEK_HOLE) != S_HOLE_END + 4096)
+			ret = ERR_CMP;
+		if (fsync(fd) && !ret)
+			ret = ERR_WRITE;
+	}
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
+
+int seek_hole_small_file(void)
+{
+	int ret = 0;
+
+	int fd = open(OUICHEFS_FILE_NAME(S_SMALL_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return ERR_CREATE;
+
+	if (write(fd, PAYLOAD100, 100) != 100) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	/* A sliced file is data up to its end */
+	if (lseek(fd, 0, SEEK_DATA) != 0 || lseek(fd, 10, SEEK_HOLE) != 100)
+		ret = ERR_CMP;
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
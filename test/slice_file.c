@@ -1,4 +1,8 @@
+#include <errno.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "tests.h"
 #include "util.h"
 #include "error.h"
@@ -160,3 +164,466 @@ int slice_truncate_2_1(void) {
 
 	return 0;
 }
+
+#define S_APPEND_DIR OUICHEFS_FILE_NAME("s_append")
+#define S_APPEND_LOG S_APPEND_DIR "/s_append_log.txt"
+#define S_APPEND_NEIGHBOUR S_APPEND_DIR "/s_append_neighbour.txt"
+
+/* Append payload (len bytes) to the file name */
+static int slice_append(const char *name, const char *payload, int len)
+{
+	int ret;
+	FILE *file = fopen(name, "a");
+	if (!file)
+		return ERR_CREATE;
+
+	ret = fprintf(file, "%s", payload);
+	if (ret != len) {
+		fprintf(stderr, "%s: fprintf returned %d", __func__, ret);
+		fclose(file);
+		return ERR_WRITE;
+	}
+
+	ret = fclose(file);
+	if (ret)
+		return ERR_CLOSE;
+
+	return 0;
+}
+
+/*
+ * Grow a file one slice at a time: in place while the next slices are free,
+ * by moving it once a neighbour takes the next slice. The log first takes
+ * four slices and is truncated to one, so that the next three are free.
+ */
+int slice_append_in_place(void)
+{
+	unsigned int bno, slice_no, new_bno, new_slice_no;
+	int ret, i;
+	FILE *file;
+
+	ret = make_test_dir(S_APPEND_DIR);
+	if (!ret)
+		ret = slice_append(S_APPEND_LOG, PAYLOAD200 PAYLOAD200, 400);
+	if (!ret && truncate(S_APPEND_LOG, 100))
+		ret = ERR_WRITE;
+	if (!ret)
+		ret = slice_location(S_APPEND_LOG, &bno, &slice_no);
+
+	for (i = 1; i < 10 && !ret; i++) {
+		ret = slice_append(S_APPEND_LOG, PAYLOAD100, 100);
+		if (ret)
+			break;
+
+		/* Up to 400 bytes, the log grows over the slices it freed */
+		if (i < 4) {
+			ret = slice_location(S_APPEND_LOG, &new_bno,
+					     &new_slice_no);
+			if (!ret && (new_bno != bno || new_slice_no != slice_no))
+				ret = ERR_CMP;
+		}
+
+		/* Takes the slice right after the log once */
+		if (!ret && i == 4)
+			ret = slice_append(S_APPEND_NEIGHBOUR, PAYLOAD100, 100);
+	}
+	if (ret)
+		goto out;
+
+	file = fopen(S_APPEND_LOG, "r");
+	if (!file) {
+		ret = ERR_OPEN;
+		goto out;
+	}
+	ret = read_and_cmp_content(file, PAYLOAD1000);
+	fclose(file);
+	if (ret)
+		goto out;
+
+	file = fopen(S_APPEND_NEIGHBOUR, "r");
+	if (!file) {
+		ret = ERR_OPEN;
+		goto out;
+	}
+	ret = read_and_cmp_content(file, PAYLOAD100);
+	fclose(file);
+
+out:
+	if (remove_test_dir(S_APPEND_DIR) && !ret)
+		ret = ERR_REMOVE;
+	return ret;
+}
+
+#define S_CLASS_NAME "s_class.txt"
+
+/* Files of each slice size class, and a file moving from one class to another */
+int slice_size_classes(void)
+{
+	static char *const payloads[] = { PAYLOAD100, PAYLOAD500, PAYLOAD1000,
+					  PAYLOAD2500, PAYLOAD3000 };
+	static const int sizes[] = { 100, 500, 1000, 2500, 3000 };
+	char name[64];
+	FILE *file;
+	int ret, i;
+
+	for (i = 0; i < 5; i++) {
+		snprintf(name, sizeof(name), OUICHEFS_FILE_NAME("s_class_%d.txt"),
+			 i);
+		remove(name);
+		ret = slice_append(name, payloads[i], sizes[i]);
+		if (ret)
+			return ret;
+	}
+
+	remove(OUICHEFS_FILE_NAME(S_CLASS_NAME));
+	ret = slice_append(OUICHEFS_FILE_NAME(S_CLASS_NAME), PAYLOAD500, 500);
+	if (!ret)
+		ret = slice_append(OUICHEFS_FILE_NAME(S_CLASS_NAME), PAYLOAD500,
+				   500);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < 5; i++) {
+		snprintf(name, sizeof(name), OUICHEFS_FILE_NAME("s_class_%d.txt"),
+			 i);
+		file = fopen(name, "r");
+		if (!file)
+			return ERR_OPEN;
+		ret = read_and_cmp_content(file, payloads[i]);
+		fclose(file);
+		if (ret)
+			return ret;
+	}
+
+	file = fopen(OUICHEFS_FILE_NAME(S_CLASS_NAME), "r");
+	if (!file)
+		return ERR_OPEN;
+	ret = read_and_cmp_content(file, PAYLOAD1000);
+	fclose(file);
+
+	return ret;
+}
+
+#define S_RUNS_DIR OUICHEFS_FILE_NAME("s_runs")
+#define S_RUNS_FILES 40
+
+/*
+ * Fill more than one sliced block, free every other slice of the first files
+ * and write files into the holes left behind.
+ */
+int slice_reuse_free_runs(void)
+{
+	char name[64];
+	FILE *file;
+	int ret, i;
+
+	ret = make_test_dir(S_RUNS_DIR);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < S_RUNS_FILES; i++) {
+		snprintf(name, sizeof(name), S_RUNS_DIR "/%d.txt", i);
+		ret = slice_append(name, PAYLOAD100, 100);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < S_RUNS_FILES; i += 2) {
+		snprintf(name, sizeof(name), S_RUNS_DIR "/%d.txt", i);
+		if (remove(name)) {
+			ret = ERR_REMOVE;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < S_RUNS_FILES; i += 2) {
+		snprintf(name, sizeof(name), S_RUNS_DIR "/%d.txt", i);
+		ret = slice_append(name, PAYLOAD100, 100);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < S_RUNS_FILES && !ret; i++) {
+		snprintf(name, sizeof(name), S_RUNS_DIR "/%d.txt", i);
+		file = fopen(name, "r");
+		if (!file) {
+			ret = ERR_OPEN;
+			break;
+		}
+		ret = read_and_cmp_content(file, PAYLOAD100);
+		fclose(file);
+	}
+
+out:
+	if (remove_test_dir(S_RUNS_DIR) && !ret)
+		ret = ERR_REMOVE;
+	return ret;
+}
+
+#define S_MID_DIR OUICHEFS_FILE_NAME("s_mid")
+#define S_MID_FILES (4 * 31)
+
+/*
+ * Fill four sliced blocks in order and empty the ones in the middle of the
+ * chain, so that they are unlinked from between their neighbours. Once the
+ * partly used blocks are full, the files go to new blocks in order, so that
+ * deleting files 31 to 92 empties at least one whole block. Once all files
+ * are gone, the partition is back to its block counts from before the test.
+ */
+int slice_free_middle_block(void)
+{
+	unsigned int sliced_before, free_before, sliced_full, sliced_mid;
+	unsigned int sliced_after, free_after;
+	char name[64];
+	FILE *file;
+	int ret, i;
+
+	ret = read_sysfs_uint("sliced_blocks", &sliced_before);
+	if (!ret)
+		ret = read_sysfs_uint("free_blocks", &free_before);
+	if (!ret)
+		ret = make_test_dir(S_MID_DIR);
+	if (ret)
+		return ret;
+
+	/* A single pool, so that the files fill the blocks one after another */
+	ret = pin_cpu();
+	if (ret)
+		goto out;
+	for (i = 0; i < S_MID_FILES && !ret; i++) {
+		snprintf(name, sizeof(name), S_MID_DIR "/%d.txt", i);
+		ret = slice_append(name, PAYLOAD100, 100);
+	}
+	unpin_cpu();
+	if (!ret)
+		ret = read_sysfs_uint("sliced_blocks", &sliced_full);
+	if (ret)
+		goto out;
+
+	for (i = 31; i < 3 * 31; i++) {
+		snprintf(name, sizeof(name), S_MID_DIR "/%d.txt", i);
+		if (remove(name)) {
+			ret = ERR_REMOVE;
+			goto out;
+		}
+	}
+	ret = read_sysfs_uint("sliced_blocks", &sliced_mid);
+	if (ret)
+		goto out;
+	if (sliced_mid >= sliced_full) {
+		ret = ERR_CMP;
+		goto out;
+	}
+
+	for (i = 0; i < S_MID_FILES && !ret; i++) {
+		if (i == 31)
+			i = 3 * 31;
+		snprintf(name, sizeof(name), S_MID_DIR "/%d.txt", i);
+		file = fopen(name, "r");
+		if (!file) {
+			ret = ERR_OPEN;
+			break;
+		}
+		ret = read_and_cmp_content(file, PAYLOAD100);
+		fclose(file);
+	}
+
+out:
+	if (remove_test_dir(S_MID_DIR) && !ret)
+		ret = ERR_REMOVE;
+	if (ret)
+		return ret;
+
+	ret = read_sysfs_uint("sliced_blocks", &sliced_after);
+	if (!ret)
+		ret = read_sysfs_uint("free_blocks", &free_after);
+	/* Background compaction may only have freed more */
+	if (!ret && (sliced_after > sliced_before || free_after < free_before))
+		ret = ERR_CMP;
+
+	return ret;
+}
+
+#define S_DIR_A OUICHEFS_FILE_NAME("s_dir_a")
+#define S_DIR_B OUICHEFS_FILE_NAME("s_dir_b")
+#define S_DIR_A_FILES 4 /* 800 B: 4 slices of 248 B each */
+#define S_DIR_B_FILES 5 /* 600 B: 3 slices of 248 B each */
+#define PAYLOAD600 PAYLOAD500 PAYLOAD100
+#define PAYLOAD800 PAYLOAD500 PAYLOAD250 PAYLOAD50
+
+/*
+ * Fill a sliced block with the files of B, put the first file of A in a new
+ * block, then free two files of B: the block of B is now the best fit for
+ * the next files of A. They still go next to their sibling, in its block.
+ */
+int slice_dir_affinity(void)
+{
+	unsigned int bno_a, bno_b, bno, slice_no;
+	char name[64];
+	FILE *file;
+	int ret, i;
+
+	ret = make_test_dir(S_DIR_A);
+	if (!ret)
+		ret = make_test_dir(S_DIR_B);
+	if (!ret)
+		ret = pin_cpu();
+	if (ret)
+		goto out;
+
+	for (i = 0; i < S_DIR_B_FILES && !ret; i++) {
+		snprintf(name, sizeof(name), S_DIR_B "/f_%d.txt", i);
+		ret = slice_append(name, PAYLOAD600, 600);
+	}
+	if (!ret)
+		ret = slice_append(S_DIR_A "/f_0.txt", PAYLOAD800, 800);
+	if (!ret && (remove(S_DIR_B "/f_1.txt") || remove(S_DIR_B "/f_2.txt")))
+		ret = ERR_REMOVE;
+	for (i = 1; i < S_DIR_A_FILES && !ret; i++) {
+		snprintf(name, sizeof(name), S_DIR_A "/f_%d.txt", i);
+		ret = slice_append(name, PAYLOAD800, 800);
+	}
+	unpin_cpu();
+	if (ret)
+		goto out;
+
+	ret = slice_location(S_DIR_A "/f_0.txt", &bno_a, &slice_no);
+	if (!ret)
+		ret = slice_location(S_DIR_B "/f_0.txt", &bno_b, &slice_no);
+	if (!ret && bno_a == bno_b)
+		ret = ERR_CMP;
+
+	for (i = 0; i < S_DIR_A_FILES && !ret; i++) {
+		snprintf(name, sizeof(name), S_DIR_A "/f_%d.txt", i);
+		file = fopen(name, "r");
+		if (!file) {
+			ret = ERR_OPEN;
+			break;
+		}
+		ret = read_and_cmp_content(file, PAYLOAD800);
+		fclose(file);
+		if (!ret)
+			ret = slice_location(name, &bno, &slice_no);
+		if (!ret && bno != bno_a)
+			ret = ERR_CMP;
+	}
+
+out:
+	if (remove_test_dir(S_DIR_A) && !ret)
+		ret = ERR_REMOVE;
+	if (remove_test_dir(S_DIR_B) && !ret)
+		ret = ERR_REMOVE;
+	return ret;
+}
+
+#define S_PAR_DIR OUICHEFS_FILE_NAME("s_par")
+#define S_PAR_WORKERS 4
+#define S_PAR_FILES 25
+#define S_PAR_SLICES 2 /* Slices of 128 B taken by each file */
+
+/*
+ * Create, then delete, a file in each of two new directories: the first goes
+ * to a new sliced block, which the second takes into the pool of this CPU.
+ */
+static int slice_pool_create_delete(void)
+{
+	static const char *const names[] = { S_PAR_DIR "/a/f.txt",
+					     S_PAR_DIR "/b/f.txt" };
+	int ret, i;
+
+	ret = make_test_dir(S_PAR_DIR "/a");
+	if (!ret)
+		ret = make_test_dir(S_PAR_DIR "/b");
+	for (i = 0; i < 2 && !ret; i++)
+		ret = slice_append(names[i], PAYLOAD1000, 1000);
+	for (i = 0; i < 2; i++)
+		remove(names[i]);
+	if (rmdir(S_PAR_DIR "/a") && !ret)
+		ret = ERR_REMOVE;
+	if (rmdir(S_PAR_DIR "/b") && !ret)
+		ret = ERR_REMOVE;
+
+	return ret;
+}
+
+/*
+ * Files of the same size created from several processes at once. Each CPU
+ * fills its own current sliced block, so the number of new sliced blocks is
+ * at most one per CPU above what the files need. Once the files are gone,
+ * including those of slice_pool_create_delete(), no sliced block is left.
+ */
+int slice_parallel_create(void)
+{
+	unsigned int before, full, after, bound;
+	char name[64];
+	FILE *file;
+	pid_t pid;
+	int ret, status, w, i;
+
+	ret = read_sysfs_uint("sliced_blocks", &before);
+	if (!ret)
+		ret = make_test_dir(S_PAR_DIR);
+	if (ret)
+		return ret;
+
+	for (w = 0; w < S_PAR_WORKERS; w++) {
+		pid = fork();
+		if (pid < 0) {
+			ret = ERR_CREATE;
+			goto out;
+		}
+		if (pid)
+			continue;
+		for (i = 0; i < S_PAR_FILES; i++) {
+			snprintf(name, sizeof(name), S_PAR_DIR "/%d_%d.txt", w,
+				 i);
+			if (slice_append(name, PAYLOAD250, 250))
+				_exit(1);
+		}
+		_exit(0);
+	}
+
+	for (w = 0; w < S_PAR_WORKERS; w++) {
+		if (wait(&status) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			ret = ERR_WRITE;
+	}
+	if (ret)
+		goto out;
+
+	for (w = 0; w < S_PAR_WORKERS && !ret; w++) {
+		for (i = 0; i < S_PAR_FILES && !ret; i++) {
+			snprintf(name, sizeof(name), S_PAR_DIR "/%d_%d.txt", w,
+				 i);
+			file = fopen(name, "r");
+			if (!file) {
+				ret = ERR_OPEN;
+				break;
+			}
+			ret = read_and_cmp_content(file, PAYLOAD250);
+			fclose(file);
+		}
+	}
+	if (ret)
+		goto out;
+
+	bound = (S_PAR_WORKERS * S_PAR_FILES * S_PAR_SLICES + 30) / 31 +
+		sysconf(_SC_NPROCESSORS_CONF);
+	ret = read_sysfs_uint("sliced_blocks", &full);
+	if (!ret && full - before > bound)
+		ret = ERR_CMP;
+	if (!ret)
+		ret = slice_pool_create_delete();
+
+out:
+	if (remove_test_dir(S_PAR_DIR) && !ret)
+		ret = ERR_REMOVE;
+	if (ret)
+		return ret;
+
+	ret = read_sysfs_uint("sliced_blocks", &after);
+	if (!ret && after > before)
+		ret = ERR_CMP;
+
+	return ret;
+}
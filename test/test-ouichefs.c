@@ -31,16 +31,45 @@ int main(void)
 	failed_count += run_and_check(append_small_to_small_file, NAMEOF(append_small_to_small_file));
 	failed_count += run_and_check(append_small_to_big_file, NAMEOF(append_small_to_big_file));
 	failed_count += run_and_check(append_big_to_big_file, NAMEOF(append_big_to_big_file));
+	failed_count += run_and_check(append_large_to_small_file, NAMEOF(append_large_to_small_file));
 
 	failed_count += run_and_check(truncate_small_to_empty_file, NAMEOF(truncate_small_to_empty_file));
 	failed_count += run_and_check(truncate_small_to_small_file, NAMEOF(truncate_small_to_small_file));
 	failed_count += run_and_check(truncate_big_to_empty_file, NAMEOF(truncate_big_to_empty_file));
 	failed_count += run_and_check(truncate_big_to_small_file, NAMEOF(truncate_big_to_small_file));
 	failed_count += run_and_check(truncate_big_to_big_file, NAMEOF(truncate_big_to_big_file));
+	failed_count += run_and_check(ftruncate_big_file, NAMEOF(ftruncate_big_file));
+	failed_count += run_and_check(ftruncate_big_to_small_file, NAMEOF(ftruncate_big_to_small_file));
+	failed_count += run_and_check(ftruncate_small_file, NAMEOF(ftruncate_small_file));
 
 	failed_count += run_and_check(slice_expand_1_2, NAMEOF(slice_expand_1_2));
 	failed_count += run_and_check(slice_expand_next_block, NAMEOF(slice_expand_next_block));
 	failed_count += run_and_check(slice_truncate_2_1, NAMEOF(slice_truncate_2_1));
+	failed_count += run_and_check(slice_append_in_place, NAMEOF(slice_append_in_place));
+	failed_count += run_and_check(slice_size_classes, NAMEOF(slice_size_classes));
+	failed_count += run_and_check(slice_reuse_free_runs, NAMEOF(slice_reuse_free_runs));
+	failed_count += run_and_check(slice_free_middle_block, NAMEOF(slice_free_middle_block));
+	failed_count += run_and_check(slice_dir_affinity, NAMEOF(slice_dir_affinity));
+	failed_count += run_and_check(slice_parallel_create, NAMEOF(slice_parallel_create));
+
+	failed_count += run_and_check(direct_io_big_file, NAMEOF(direct_io_big_file));
+	failed_count += run_and_check(direct_io_small_file, NAMEOF(direct_io_small_file));
+
+	failed_count += run_and_check(mmap_small_file, NAMEOF(mmap_small_file));
+
+	failed_count += run_and_check(falloc_big_file, NAMEOF(falloc_big_file));
+	failed_count += run_and_check(punch_hole_big_file, NAMEOF(punch_hole_big_file));
+
+	failed_count += run_and_check(seek_hole_big_file, NAMEOF(seek_hole_big_file));
+	failed_count += run_and_check(seek_hole_small_file, NAMEOF(seek_hole_small_file));
+
+	failed_count += run_and_check(inline_grow_file, NAMEOF(inline_grow_file));
+	failed_count += run_and_check(inline_gap_file, NAMEOF(inline_gap_file));
+
+	failed_count += run_and_check(compact_sparse_slices, NAMEOF(compact_sparse_slices));
+
+	failed_count += run_and_check(ingest_small_files, NAMEOF(ingest_small_files));
+	failed_count += run_and_check(batch_read_small_files, NAMEOF(batch_read_small_files));
 
 	if (failed_count) {
 		fprintf(stderr, "Failed tests: %d\n", failed_count);
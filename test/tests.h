@@ -7,17 +7,46 @@ int append_empty_to_big_file(void);
 int append_small_to_small_file(void);
 int append_small_to_big_file(void);
 int append_big_to_big_file(void);
+int append_large_to_small_file(void);
 
 int truncate_small_to_empty_file(void);
 int truncate_small_to_small_file(void);
 int truncate_big_to_empty_file(void);
 int truncate_big_to_small_file(void);
 int truncate_big_to_big_file(void);
+int ftruncate_big_file(void);
+int ftruncate_big_to_small_file(void);
+int ftruncate_small_file(void);
 
 int slice_expand_1_2(void);
 int slice_expand_next_block(void);
 int slice_truncate_2_1(void);
+int slice_append_in_place(void);
+int slice_size_classes(void);
+int slice_reuse_free_runs(void);
+int slice_free_middle_block(void);
+int slice_dir_affinity(void);
+int slice_parallel_create(void);
 
 int remove_empty_file(void);
 int remove_small_file(void);
 int remove_big_file(void);
+
+int direct_io_big_file(void);
+int direct_io_small_file(void);
+
+int mmap_small_file(void);
+
+int falloc_big_file(void);
+int punch_hole_big_file(void);
+
+int seek_hole_big_file(void);
+int seek_hole_small_file(void);
+
+int inline_grow_file(void);
+int inline_gap_file(void);
+
+int compact_sparse_slices(void);
+
+int ingest_small_files(void);
+int batch_read_small_files(void);
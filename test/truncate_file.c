@@ -1,4 +1,8 @@
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "util.h"
 #include "error.h"
 #include "tests.h"
@@ -243,3 +247,131 @@ int truncate_big_to_big_file(void)
 
 	return 0;
 }
+
+/* Check that the file is size bytes long, made of c up to split, then zeroes */
+static int check_sized_content(int fd, off_t size, off_t split, char c)
+{
+	char buf[4096];
+	struct stat st;
+	off_t off;
+
+	if (fstat(fd, &st) || st.st_size != size)
+		return ERR_CMP;
+
+	for (off = 0; off < size; off++) {
+		if (off % sizeof(buf) == 0 &&
+		    pread(fd, buf, sizeof(buf), off) <= 0)
+			return ERR_READ;
+		if (buf[off % sizeof(buf)] != (off < split ? c : 0))
+			return ERR_CMP;
+	}
+
+	return 0;
+}
+
+#define FT_BIG_NAME "ftbig.txt"
+#define FT_BIG_SIZE (16 * 4096)
+
+int ftruncate_big_file(void)
+{
+	char buf[FT_BIG_SIZE];
+	int ret;
+
+	int fd = open(OUICHEFS_FILE_NAME(FT_BIG_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return ERR_CREATE;
+
+	memset(buf, 'a', FT_BIG_SIZE);
+	if (write(fd, buf, FT_BIG_SIZE) != FT_BIG_SIZE) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	/* Shrink in the middle of a block, then grow back: the tail is zeroes */
+	if (ftruncate(fd, 5000)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	ret = check_sized_content(fd, 5000, 5000, 'a');
+	if (ret)
+		goto close;
+
+	if (ftruncate(fd, 3 * 4096)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	ret = check_sized_content(fd, 3 * 4096, 5000, 'a');
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
+
+#define FT_BIG_SMALL_NAME "ftbigsmall.txt"
+
+int ftruncate_big_to_small_file(void)
+{
+	char buf[2 * 4096];
+	int ret;
+
+	int fd = open(OUICHEFS_FILE_NAME(FT_BIG_SMALL_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return ERR_CREATE;
+
+	memset(buf, 'a', sizeof(buf));
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	if (ftruncate(fd, 100)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	ret = check_sized_content(fd, 100, 100, 'a');
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
+
+#define FT_SMALL_NAME "ftsmall.txt"
+
+int ftruncate_small_file(void)
+{
+	int ret;
+
+	int fd = open(OUICHEFS_FILE_NAME(FT_SMALL_NAME),
+		      O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return ERR_CREATE;
+
+	if (write(fd, PAYLOAD100, 100) != 100) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+
+	/* Grows within the small file limit, then shrinks below the start */
+	if (ftruncate(fd, 300)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	ret = check_sized_content(fd, 300, 100, 'a');
+	if (ret)
+		goto close;
+
+	if (ftruncate(fd, 50)) {
+		ret = ERR_WRITE;
+		goto close;
+	}
+	ret = check_sized_content(fd, 50, 50, 'a');
+
+close:
+	if (close(fd) && !ret)
+		ret = ERR_CLOSE;
+	return ret;
+}
@@ -1,6 +1,17 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 
+#include "../ioctl.h"
 #include "util.h"
 
 int read_and_cmp_content(FILE *file, char *expected)
@@ -26,3 +37,170 @@ int read_and_cmp_content(FILE *file, char *expected)
 
 	return 0;
 }
+
+int make_test_dir(const char *dir)
+{
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return ERR_CREATE;
+
+	return 0;
+}
+
+int remove_test_dir(const char *dir)
+{
+	char name[512];
+	struct dirent *d;
+	DIR *dirp;
+	int ret = 0;
+
+	dirp = opendir(dir);
+	if (!dirp)
+		return ERR_OPEN;
+	while ((d = readdir(dirp))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		snprintf(name, sizeof(name), "%s/%s", dir, d->d_name);
+		if (unlink(name))
+			ret = ERR_REMOVE;
+	}
+	closedir(dirp);
+
+	if (rmdir(dir) && !ret)
+		ret = ERR_REMOVE;
+
+	return ret;
+}
+
+/* Path of attribute attr of the mounted ouichefs partition in sysfs */
+static int sysfs_path(const char *attr, char *path, size_t len)
+{
+	char pattern[64];
+	glob_t g;
+	int ret = ERR_OPEN;
+
+	snprintf(pattern, sizeof(pattern), "/sys/fs/ouichefs/*/%s", attr);
+	if (glob(pattern, 0, NULL, &g))
+		return ret;
+	if (g.gl_pathc == 1) {
+		snprintf(path, len, "%s", g.gl_pathv[0]);
+		ret = 0;
+	}
+	globfree(&g);
+
+	return ret;
+}
+
+int read_sysfs_uint(const char *attr, unsigned int *val)
+{
+	char path[256];
+	FILE *file;
+	int ret;
+
+	ret = sysfs_path(attr, path, sizeof(path));
+	if (ret)
+		return ret;
+	file = fopen(path, "r");
+	if (!file)
+		return ERR_OPEN;
+	ret = fscanf(file, "%u", val) == 1 ? 0 : ERR_READ;
+	fclose(file);
+
+	return ret;
+}
+
+int write_sysfs(const char *attr, const char *val)
+{
+	char path[256];
+	FILE *file;
+	int ret;
+
+	ret = sysfs_path(attr, path, sizeof(path));
+	if (ret)
+		return ret;
+	file = fopen(path, "w");
+	if (!file)
+		return ERR_OPEN;
+	ret = fputs(val, file) < 0 ? ERR_WRITE : 0;
+	if (fclose(file) && !ret)
+		ret = ERR_CLOSE;
+
+	return ret;
+}
+
+static cpu_set_t saved_cpus;
+
+int pin_cpu(void)
+{
+	cpu_set_t set;
+	int cpu = sched_getcpu();
+
+	if (cpu < 0 || sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus))
+		return ERR_OPEN;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		return ERR_OPEN;
+
+	return 0;
+}
+
+void unpin_cpu(void)
+{
+	sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+}
+
+#define OUICHEFS_DEV "/dev/ouichefs"
+
+/* Open the debug device, creating its node from /proc/devices if needed */
+static int open_debug_dev(void)
+{
+	unsigned int major;
+	char line[64];
+	FILE *file;
+	int fd;
+
+	fd = open(OUICHEFS_DEV, O_RDONLY);
+	if (fd >= 0 || errno != ENOENT)
+		return fd;
+
+	file = fopen("/proc/devices", "r");
+	if (!file)
+		return -1;
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%u ouichefs", &major) == 1 &&
+		    strstr(line, " ouichefs\n")) {
+			mknod(OUICHEFS_DEV, S_IFCHR | 0600, makedev(major, 0));
+			break;
+		}
+	}
+	fclose(file);
+
+	return open(OUICHEFS_DEV, O_RDONLY);
+}
+
+int slice_location(const char *name, unsigned int *bno,
+		   unsigned int *slice_no)
+{
+	struct ouichefs_debug_ioctl arg = { 0 };
+	int dev, fd, ret = 0;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return ERR_OPEN;
+	dev = open_debug_dev();
+	if (dev < 0) {
+		close(fd);
+		return ERR_OPEN;
+	}
+
+	arg.target_file = fd;
+	if (ioctl(dev, OUICHEFS_DEBUG_IOCTL, &arg))
+		ret = ERR_READ;
+	*bno = arg.bno;
+	*slice_no = arg.slice_no;
+
+	close(dev);
+	close(fd);
+
+	return ret;
+}
@@ -19,3 +19,19 @@
 
 int read_and_cmp_content(FILE *file, char *expected);
 
+/* Directory of a test, created if needed, then removed with its files */
+int make_test_dir(const char *dir);
+int remove_test_dir(const char *dir);
+
+/* Attributes of the mounted partition in /sys/fs/ouichefs */
+int read_sysfs_uint(const char *attr, unsigned int *val);
+int write_sysfs(const char *attr, const char *val);
+
+/* Keep the test on its current CPU, so that it uses a single slice pool */
+int pin_cpu(void);
+void unpin_cpu(void);
+
+/* Sliced block and first slice of a small file, from the debug ioctl */
+int slice_location(const char *name, unsigned int *bno,
+		   unsigned int *slice_no);
+